@@ -0,0 +1,254 @@
+#include <iostream>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "../main/Emulator.hpp"
+using namespace std;
+
+/**
+ * Per-opcode microbenchmarks for the CPU core.
+ * Times every implemented opcode and CB opcode in isolation, the CPU helpers, and a few realistic
+ * instruction mixes, then prints ns/instruction and optionally writes the results as JSON.
+ * Usage: opcode_bench [--json out.json] [--samples N]
+ */
+
+struct Result {
+    string name;
+    double mean, stddev, min; // ns per instruction
+};
+
+static int samples = 25;
+static const int batch = 20000; // Instructions per sample
+
+static volatile unsigned short opcodeSource; // Read through volatile so the opcode isn't constant folded
+
+/**
+ * Stops the compiler from optimizing away or merging the work done on `p` between calls.
+ */
+static inline void keep(const void *p){
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+/**
+ * Runs `body` (which executes `batch` instructions) `samples` times and summarizes ns/instruction.
+ */
+static Result measure(const string &name, const function<void()> &body){
+    body(); // Warm up
+    vector<double> times;
+    for (int i = 0; i < samples; i++){
+        auto start = chrono::steady_clock::now();
+        body();
+        times.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / batch);
+    }
+    Result result = {name, 0, 0, times[0]};
+    for (double t : times){
+        result.mean += t;
+        result.min = min(result.min, t);
+    }
+    result.mean /= times.size();
+    for (double t : times){
+        result.stddev += (t - result.mean) * (t - result.mean);
+    }
+    result.stddev = sqrt(result.stddev / times.size());
+    return result;
+}
+
+/**
+ * Puts `cpu` in a fixed state: registers pointing at RAM and a page of varied data.
+ */
+static void prepare(CPU &cpu){
+    cpu.initialize();
+    cpu.AF = 0x12B0;
+    cpu.BC = 0xC123;
+    cpu.DE = 0xC456;
+    cpu.HL = 0xC789;
+    cpu.SP = 0xDFF0;
+    cpu.PC = 0xC000;
+    assert(!cpu.memory.dma); // The writes below would land in its busy page
+    for (int i = 0; i < 0x100; i++){
+        cpu.memory[0xC000 + i] = (i * 37) & 0xFF;
+    }
+}
+
+/**
+ * \return true if `opcode` decodes (doesn't fault).
+ */
+static bool implemented(CPU &cpu, unsigned short opcode){
+    prepare(cpu);
+    cpu.executeOpcode(opcode);
+    return !cpu.fault;
+}
+
+/**
+ * Times executeOpcode(`opcode`) with the registers prepare() set put back before every instruction,
+ * so jumps and immediates always see the same bytes and loads and stores the same fixed addresses
+ * in WRAM, whatever was measured before. The reset is part of every number.
+ */
+static Result timeOpcode(CPU &cpu, unsigned short opcode){
+    char name[8];
+    snprintf(name, sizeof(name), "0x%02X", opcode & 0xFF);
+    prepare(cpu);
+    const unsigned short AF = cpu.AF, BC = cpu.BC, DE = cpu.DE, HL = cpu.HL, SP = cpu.SP, PC = cpu.PC;
+    opcodeSource = opcode;
+    return measure(name, [&]{
+        unsigned short op = opcodeSource;
+        for (int i = 0; i < batch; i++){
+            cpu.AF = AF;
+            cpu.BC = BC;
+            cpu.DE = DE;
+            cpu.HL = HL;
+            cpu.SP = SP;
+            cpu.PC = PC;
+            cpu.executeOpcode(op);
+        }
+    });
+}
+
+/**
+ * Times Emulator::step over `program`, which must loop forever. It is placed at 0x0150 of a blank ROM.
+ */
+static Result timeMix(const string &name, const vector<unsigned char> &program){
+    static vector<unsigned char> rom;
+    rom.assign(0x8000, 0x00);
+    memcpy(&rom[0x0150], program.data(), program.size());
+    Emulator *emulator = new Emulator();
+    emulator->initialize();
+    emulator->loadROM(rom.data(), rom.size());
+    emulator->cpu.PC = 0x0150;
+    emulator->cpu.HL = 0xC000;
+    emulator->cpu.DE = 0xD000;
+    Result result = measure(name, [emulator]{
+        for (int i = 0; i < batch; i++){
+            emulator->step();
+        }
+    });
+    if (emulator->cpu.fault){
+        result.name += " (faulted)";
+    }
+    delete emulator;
+    return result;
+}
+
+static void print(const char *section, const vector<Result> &results){
+    printf("%s\n", section);
+    for (const Result &r : results){
+        printf("  %-28s %8.2f ns  +/- %6.2f  (min %.2f)\n", r.name.c_str(), r.mean, r.stddev, r.min);
+    }
+}
+
+static void writeJSON(FILE *out, const char *section, const vector<Result> &results, bool last){
+    fprintf(out, "  \"%s\": [\n", section);
+    for (size_t i = 0; i < results.size(); i++){
+        const Result &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"ns\": %.4f, \"stddev\": %.4f, \"min\": %.4f}%s\n",
+            r.name.c_str(), r.mean, r.stddev, r.min, (i + 1 < results.size())? ",":"");
+    }
+    fprintf(out, "  ]%s\n", last? "":",");
+}
+
+int main (int argc, char *argv[]){
+    const char *jsonPath = nullptr;
+    for (int i = 1; i + 1 < argc; i += 2){
+        if (strcmp(argv[i], "--json") == 0){
+            jsonPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--samples") == 0){
+            samples = max(2, atoi(argv[i + 1]));
+        }
+    }
+
+    CPU *cpu = new CPU();
+    vector<Result> opcodes, cbOpcodes, helpers, mixes;
+    for (unsigned short opcode = 0x00; opcode <= 0xFF; opcode++){
+        if (opcode != 0xCB && implemented(*cpu, opcode)){
+            opcodes.push_back(timeOpcode(*cpu, opcode));
+        }
+    }
+    for (unsigned short opcode = 0xCB00; opcode <= 0xCBFF; opcode++){
+        if (implemented(*cpu, opcode)){
+            Result result = timeOpcode(*cpu, opcode);
+            result.name = "0xCB" + result.name.substr(2);
+            cbOpcodes.push_back(result);
+        }
+    }
+
+    prepare(*cpu);
+    helpers.push_back(measure("loadReg", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->loadReg(i >> 8, i, cpu->BC);
+            keep(cpu);
+        }
+    }));
+    helpers.push_back(measure("storeReg", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->storeReg(i, 0xC000 | (i & 0x1FFF));
+            keep(cpu);
+        }
+    }));
+    helpers.push_back(measure("incReg (8-bit)", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->incReg((i & 1)? 1:-1, cpu->BC, HIGH);
+            keep(cpu);
+        }
+    }));
+    helpers.push_back(measure("incReg (pair)", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->incReg(1, cpu->DE, PAIR);
+            keep(cpu);
+        }
+    }));
+    helpers.push_back(measure("incMem", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->incMem((i & 1)? 1:-1, 0xC000 | (i & 0x1FFF));
+            keep(cpu);
+        }
+    }));
+    helpers.push_back(measure("rotate", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->rotate(cpu->AF, i & 1, (i & 2)? LEFT:RIGHT, HIGH);
+            keep(cpu);
+        }
+    }));
+    helpers.push_back(measure("addPairs", [cpu]{
+        for (int i = 0; i < batch; i++){
+            cpu->addPairs(cpu->HL, cpu->BC);
+            keep(cpu);
+        }
+    }));
+
+    mixes.push_back(timeMix("alu", {
+        0x04, 0x0C, 0x09, 0x07, 0x15, 0x0D, 0x19, 0x17, 0x03, 0x1B, 0x29, 0x0F, 0x18, 0xF2 // ... JR -14
+    }));
+    mixes.push_back(timeMix("load/store", {
+        0x2A, 0x12, 0x13, 0x06, 0x42, 0x0E, 0x99, 0x22, 0x1A, 0x32, 0x0A, 0x02, 0x23, 0x18, 0xF1 // ... JR -15
+    }));
+    mixes.push_back(timeMix("branchy", {
+        0x00, 0x37, 0x38, 0x01, 0x00, 0x28, 0x02, 0x04, 0x00, 0x05, 0x18, 0xF4 // ... JR -12
+    }));
+
+    print("opcodes", opcodes);
+    print("cb opcodes", cbOpcodes);
+    print("helpers", helpers);
+    print("mixes (Emulator::step)", mixes);
+
+    if (jsonPath){
+        FILE *out = fopen(jsonPath, "w");
+        if (!out){
+            cerr << "Could not open " << jsonPath << endl;
+            return 1;
+        }
+        fprintf(out, "{\n  \"samples\": %d,\n  \"batch\": %d,\n", samples, batch);
+        writeJSON(out, "opcodes", opcodes, false);
+        writeJSON(out, "cb", cbOpcodes, false);
+        writeJSON(out, "helpers", helpers, false);
+        writeJSON(out, "mixes", mixes, true);
+        fprintf(out, "}\n");
+        fclose(out);
+    }
+    delete cpu;
+    return 0;
+}
@@ -0,0 +1,144 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include "Emulator.hpp"
+
+static_assert(sizeof(Emulator) < 70 * 1024, "Emulator instances should stay under 70KB, the cartridge ROM is shared");
+
+/**
+ * Fixed pool of emulator instances carved out of one large mapping, backed by huge pages where
+ * the host allows it. The mapping also holds the pages instances share copy-on-write (see
+ * Memory::pool), room for 128 per instance, which is as many as instances that are only copied into
+ * each other can keep alive: create(), fork() and destroy() never touch the general heap. Copies of
+ * instances made outside the arena must not outlive it.
+ */
+class Arena {
+public:
+	static const size_t slotSize = (sizeof(Emulator) + 63) / 64 * 64; // Cache line aligned instances
+
+	size_t capacity; // Number of instances the arena can hold
+	size_t live; // Instances currently created
+	bool hugePages; // True if the mapping is explicitly backed by huge pages
+
+	Arena(size_t capacity);
+	~Arena();
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	Emulator *create(const unsigned char *rom, size_t size);
+	Emulator *fork(Emulator *parent);
+	void destroy(Emulator *emulator);
+
+private:
+	unsigned char *base;
+	size_t mapped; // Bytes mapped at base
+	size_t used; // Slots handed out at least once, everything after them is untouched
+	void *freeList; // Destroyed slots, linked through their first bytes
+	PagePool pages; // Carved out of the mapping after the slots
+	std::mutex lock;
+
+	void *acquire();
+};
+
+/**
+ * Reserves room for `capacity` instances. If the mapping fails `capacity` is set to 0.
+ */
+Arena::Arena(size_t instances) : capacity(instances), live(0), hugePages(false), used(0), freeList(nullptr){
+	const size_t hugePage = 2 * 1024 * 1024;
+	const size_t slots = capacity * slotSize;
+	mapped = (slots + capacity * 128 * sizeof(SharedPage) + hugePage - 1) / hugePage * hugePage;
+	void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	hugePages = memory != MAP_FAILED;
+#endif
+	if (memory == MAP_FAILED){ // No reserved huge pages, ask for transparent ones instead
+		memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+		if (memory != MAP_FAILED) madvise(memory, mapped, MADV_HUGEPAGE);
+#endif
+	}
+	if (memory == MAP_FAILED){
+		base = nullptr;
+		capacity = 0;
+		mapped = 0;
+	} else {
+		base = (unsigned char *)memory;
+		pages.carve(base + slots, capacity * 128);
+	}
+}
+
+/**
+ * Unmaps the arena. Instances still alive are dropped without running their destructors.
+ */
+Arena::~Arena(){
+	if (base){
+		munmap(base, mapped);
+	}
+}
+
+/**
+ * Takes a free slot, or nullptr if the arena is full.
+ */
+void *Arena::acquire(){
+	std::lock_guard<std::mutex> guard(lock);
+	void *slot = nullptr;
+	if (freeList){
+		slot = freeList;
+		freeList = *(void **)slot;
+	} else if (used < capacity){
+		slot = base + used++ * slotSize;
+	}
+	if (slot){
+		live++;
+	}
+	return slot;
+}
+
+/**
+ * Creates an initialized emulator running `rom`, which is shared and must outlive the instance.
+ * \return nullptr if the arena is full or the ROM is smaller than 32KB.
+ */
+Emulator *Arena::create(const unsigned char *rom, size_t size){
+	void *slot = acquire();
+	if (!slot){
+		return nullptr;
+	}
+	Emulator *emulator = new (slot) Emulator(&pages);
+	emulator->initialize();
+	if (!emulator->loadROM(rom, size)){
+		destroy(emulator);
+		return nullptr;
+	}
+	return emulator;
+}
+
+/**
+ * Creates a copy-on-write child of `parent` (see Emulator::fork).
+ * \return nullptr if the arena is full.
+ */
+Emulator *Arena::fork(Emulator *parent){
+	void *slot = acquire();
+	if (!slot){
+		return nullptr;
+	}
+	Emulator *child = new (slot) Emulator(&pages);
+	parent->fork(*child);
+	return child;
+}
+
+/**
+ * Returns an instance made by create() or fork() to the arena.
+ */
+void Arena::destroy(Emulator *emulator){
+	emulator->~Emulator();
+	std::lock_guard<std::mutex> guard(lock);
+	*(void **)emulator = freeList;
+	freeList = emulator;
+	live--;
+}
+
+#endif
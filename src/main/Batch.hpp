@@ -0,0 +1,193 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Emulator.hpp"
+#include "ThreadPool.hpp"
+
+/**
+ * RUN_MODE is how long a batch job runs for.
+ * \param CYCLES a fixed number of T-cycles.
+ * \param FRAMES a fixed number of frames.
+ * \param MOVIE one frame per byte of an input movie, the byte being the pressed buttons.
+ */
+enum RUN_MODE {CYCLES, FRAMES, MOVIE};
+
+/**
+ * One line of a batch manifest:
+ *     <rom> <cycles=N | frames=N | movie=path> [hash,regs,perf]
+ * Blank lines and lines starting with '#' are skipped.
+ */
+struct BatchJob {
+	std::string rom;
+	RUN_MODE mode;
+	unsigned long long amount; // Cycles or frames
+	std::string movie;
+	bool hash = true, regs = false, perf = false; // Output spec
+};
+
+class Batch {
+public:
+	std::vector<BatchJob> jobs;
+	std::string error; // Set when parse() or run() fails
+
+	bool parse(const char *manifestPath);
+	bool run(const char *outputPath, unsigned threads = 0);
+
+private:
+	std::map<std::string, std::vector<unsigned char>> files; // ROMs and movies, read once and shared by every job
+	std::vector<std::string> results; // One JSON line per job
+
+	const std::vector<unsigned char> *file(const std::string &path);
+	void runJob(size_t index, Emulator &emulator);
+};
+
+/**
+ * Reads the manifest at `manifestPath` into `jobs`.
+ */
+bool Batch::parse(const char *manifestPath){
+	std::ifstream manifest(manifestPath);
+	if (!manifest){
+		error = std::string("could not open manifest ") + manifestPath;
+		return false;
+	}
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(manifest, line)){
+		lineNumber++;
+		std::istringstream fields(line);
+		BatchJob job;
+		std::string run, output;
+		if (!(fields >> job.rom) || job.rom[0] == '#'){
+			continue;
+		}
+		fields >> run >> output;
+		size_t equals = run.find('=');
+		std::string key = run.substr(0, equals), value = (equals == std::string::npos)? "":run.substr(equals + 1);
+		if (key == "cycles" || key == "frames"){
+			job.mode = (key == "cycles")? CYCLES:FRAMES;
+			job.amount = strtoull(value.c_str(), nullptr, 10);
+		} else if (key == "movie"){
+			job.mode = MOVIE;
+			job.movie = value;
+		} else {
+			error = "line " + std::to_string(lineNumber) + ": expected cycles=N, frames=N or movie=path";
+			return false;
+		}
+		if (!output.empty()){
+			job.hash = output.find("hash") != std::string::npos;
+			job.regs = output.find("regs") != std::string::npos;
+			job.perf = output.find("perf") != std::string::npos;
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+/**
+ * Runs every job on a work-stealing pool and writes one JSON line per job, in manifest order, to `outputPath`.
+ * \param threads Number of workers, 0 for one per core.
+ */
+bool Batch::run(const char *outputPath, unsigned threads){
+	// Load every file up front so workers only ever read shared data
+	for (const BatchJob &job : jobs){
+		if (!file(job.rom) || (job.mode == MOVIE && !file(job.movie))){
+			return false;
+		}
+	}
+	results.assign(jobs.size(), std::string());
+	{
+		ThreadPool pool(threads);
+		for (size_t i = 0; i < jobs.size(); i++){
+			pool.submit([this, i]{
+				thread_local std::unique_ptr<Emulator> emulator(new Emulator()); // One instance per worker, reused across jobs
+				runJob(i, *emulator);
+			});
+		}
+		pool.wait();
+	}
+
+	FILE *output = fopen(outputPath, "w");
+	if (!output){
+		error = std::string("could not open output ") + outputPath;
+		return false;
+	}
+	for (const std::string &result : results){
+		fputs(result.c_str(), output);
+	}
+	fclose(output);
+	return true;
+}
+
+const std::vector<unsigned char> *Batch::file(const std::string &path){
+	auto found = files.find(path);
+	if (found != files.end()){
+		return &found->second;
+	}
+	std::vector<unsigned char> contents;
+	if (!readROM(path.c_str(), contents)){
+		error = "could not open " + path;
+		return nullptr;
+	}
+	return &(files[path] = std::move(contents));
+}
+
+void Batch::runJob(size_t index, Emulator &emulator){
+	const BatchJob &job = jobs[index];
+	const std::vector<unsigned char> &rom = files.at(job.rom);
+	emulator.initialize();
+	if (!emulator.loadROM(rom.data(), rom.size())){
+		results[index] = "{\"job\":" + std::to_string(index) + ",\"error\":\"ROM smaller than 32KB\"}\n";
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	switch (job.mode){
+		case CYCLES: emulator.runCycles(job.amount); break;
+		case FRAMES: emulator.runFrames(job.amount); break;
+		case MOVIE:
+			for (unsigned char buttons : files.at(job.movie)){
+				if (emulator.cpu.fault) break;
+				emulator.setButtons(buttons);
+				emulator.runFrames(1);
+			}
+			break;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::string escaped;
+	for (char c : job.rom){
+		if (c == '"' || c == '\\') escaped += '\\';
+		escaped += c;
+	}
+	char buffer[256];
+	std::string &result = results[index];
+	result = "{\"job\":" + std::to_string(index) + ",\"rom\":\"" + escaped + "\"";
+	snprintf(buffer, sizeof(buffer), ",\"frames\":%llu,\"cycles\":%llu,\"instructions\":%llu,\"fault\":%s",
+		emulator.ppu.frames, emulator.cpu.cycles, emulator.instructions, emulator.cpu.fault? "true":"false");
+	result += buffer;
+	if (job.hash){
+		snprintf(buffer, sizeof(buffer), ",\"hash\":\"0x%016llX\"", emulator.stateHash());
+		result += buffer;
+	}
+	if (job.regs){
+		const CPU &cpu = emulator.cpu;
+		snprintf(buffer, sizeof(buffer), ",\"regs\":{\"AF\":%u,\"BC\":%u,\"DE\":%u,\"HL\":%u,\"SP\":%u,\"PC\":%u}",
+			cpu.AF, cpu.BC, cpu.DE, cpu.HL, cpu.SP, cpu.PC);
+		result += buffer;
+	}
+	if (job.perf){
+		snprintf(buffer, sizeof(buffer), ",\"seconds\":%.6f", seconds);
+		result += buffer;
+	}
+	result += "}\n";
+}
+
+#endif
@@ -0,0 +1,764 @@
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "CPU.hpp"
+#include "Sampler.hpp"
+
+/**
+ * Executes one decoded instruction.
+ */
+typedef void (*BlockHandler)(CPU &cpu, unsigned short opcode);
+
+/**
+ * The plain interpreter, for instructions without a specialized handler.
+ */
+inline void interpretOpcode(CPU &cpu, unsigned short opcode){
+	cpu.executeOpcode(opcode);
+}
+
+/*
+Flags-dead variants of the instructions whose flags are usually overwritten before anything reads
+them: the same registers, PC and cycles, without working out F. The decoder picks one only when
+the liveness pass found none of the flags it writes live afterwards.
+*/
+template<int R, int AMOUNT> void incDeadFlags(CPU &cpu, unsigned short opcode){ // INC/DEC r
+	cpu.opcode = opcode;
+	cpu.reg8[reg8Offsets[R]] += AMOUNT;
+	cpu.cycles += 4;
+	cpu.PC++;
+}
+
+template<int P> void addHLDeadFlags(CPU &cpu, unsigned short opcode){ // ADD HL, dd
+	cpu.opcode = opcode;
+	cpu.HL += (P == 0)? cpu.BC:(P == 1)? cpu.DE:(P == 2)? cpu.HL:cpu.SP;
+	cpu.cycles += 8;
+	cpu.PC++;
+}
+
+template<bool CARRY> void rotateLeftDeadFlags(CPU &cpu, unsigned short opcode){ // RLCA / RLA
+	cpu.opcode = opcode;
+	unsigned char &a = cpu.reg8[reg8Offsets[7]];
+	a = a << 1 | (CARRY? (cpu.AF & cFlag) >> 4:a >> 7);
+	cpu.cycles += 4;
+	cpu.PC++;
+}
+
+inline void rotateRightDeadFlags(CPU &cpu, unsigned short opcode){ // 0x0F-0x3F
+	cpu.opcode = opcode;
+	unsigned char &a = cpu.reg8[reg8Offsets[7]];
+	a = a >> 1 | a << 7;
+	cpu.cycles += 4;
+	cpu.PC++;
+}
+
+/**
+ * ALU A, r with operand `SRC` encoded as in CPU::operand, 8 for the immediate forms.
+ */
+template<int OP, int SRC> void aluDeadFlags(CPU &cpu, unsigned short opcode){
+	cpu.opcode = opcode;
+	unsigned char value;
+	if constexpr (SRC == 8){
+		value = cpu.memory[cpu.PC + 1];
+	} else if constexpr (SRC == 6){
+		value = cpu.memory[cpu.HL];
+	} else {
+		value = cpu.reg8[reg8Offsets[SRC]];
+	}
+	unsigned char &a = cpu.reg8[reg8Offsets[7]];
+	unsigned char carry = (cpu.AF & cFlag) >> 4;
+	switch (OP){
+		case ADD: a += value; break;
+		case ADC: a += value + carry; break;
+		case SUB: a -= value; break;
+		case SBC: a -= value + carry; break;
+		case AND: a &= value; break;
+		case XOR: a ^= value; break;
+		case OR: a |= value; break;
+		default: break; // CP only sets flags
+	}
+	cpu.cycles += opcodeCycles[opcode];
+	cpu.PC += (SRC == 8)? 2:1;
+}
+
+template<int OP> constexpr BlockHandler deadFlagsVariant(){
+	constexpr int x = OP >> 6, y = (OP >> 3) & 7, z = OP & 7;
+	if constexpr (x == 0 && (z == 4 || z == 5) && y != 6){
+		return incDeadFlags<y, (z == 4)? 1:-1>;
+	} else if constexpr (x == 0 && (OP & 0x0F) == 0x09){
+		return addHLDeadFlags<(y >> 1)>;
+	} else if constexpr (OP == 0x07 || OP == 0x17){
+		return rotateLeftDeadFlags<(OP == 0x17)>;
+	} else if constexpr (x == 0 && z == 7 && (y & 1)){
+		return rotateRightDeadFlags;
+	} else if constexpr (x == 2){
+		return aluDeadFlags<y, z>;
+	} else if constexpr (x == 3 && z == 6){
+		return aluDeadFlags<y, 8>;
+	} else {
+		return nullptr;
+	}
+}
+
+template<size_t... OPCODES>
+constexpr std::array<BlockHandler, 256> makeDeadFlagsHandlers(std::index_sequence<OPCODES...>){
+	return {{deadFlagsVariant<OPCODES>()...}};
+}
+
+/**
+ * Flags-dead variant of every opcode that has one, nullptr for the rest.
+ */
+static constexpr std::array<BlockHandler, 256> deadFlagsHandlers = makeDeadFlagsHandlers(std::make_index_sequence<256>());
+
+/*
+Superinstructions: opcode pairs that dominate real code, run with one dispatch. Each leaves
+registers, flags, memory, cycles and `opcode` exactly as the two instructions would.
+*/
+template<int R> void decJumpFused(CPU &cpu, unsigned short){ // DEC r; JR NZ, e
+	unsigned char &r = cpu.reg8[reg8Offsets[R]];
+	r--;
+	cpu.AF = (cpu.AF & (0xFF00 | cFlag)) | flagTables.dec[r];
+	signed char e = cpu.memory[cpu.PC + 2];
+	cpu.opcode = 0x20;
+	cpu.cycles += 12;
+	cpu.PC += 3;
+	if (r){
+		cpu.PC += e;
+		cpu.cycles += 4;
+	}
+}
+
+inline void copyIncFused(CPU &cpu, unsigned short){ // LD A, (HL+); LD (DE), A
+	unsigned char a = cpu.memory[cpu.HL++];
+	cpu.reg8[reg8Offsets[7]] = a;
+	cpu.cycles += 16; // Before the store, as stepping both would (see CPU::storeReg's DMA)
+	cpu.storeReg(a, cpu.DE);
+	cpu.opcode = 0x12;
+	cpu.PC += 2;
+}
+
+inline void copyToIncFused(CPU &cpu, unsigned short){ // LD A, (DE); LD (HL+), A
+	unsigned char a = cpu.memory[cpu.DE];
+	cpu.reg8[reg8Offsets[7]] = a;
+	cpu.cycles += 16; // Before the store, as stepping both would (see CPU::storeReg's DMA)
+	cpu.storeReg(a, cpu.HL++);
+	cpu.opcode = 0x22;
+	cpu.PC += 2;
+}
+
+template<int P> void incDecBCFused(CPU &cpu, unsigned short){ // INC DE/HL; DEC BC
+	(P == 1)? cpu.DE++:cpu.HL++;
+	cpu.BC--;
+	cpu.opcode = 0x0B;
+	cpu.cycles += 16;
+	cpu.PC += 2;
+}
+
+inline void testBCFused(CPU &cpu, unsigned short){ // LD A, B; OR C
+	cpu.AF = aluOr((cpu.AF & 0x00FF) | (cpu.BC & 0xFF00), cpu.C());
+	cpu.opcode = 0xB1;
+	cpu.cycles += 8;
+	cpu.PC += 2;
+}
+
+struct Superinstruction {
+	unsigned char first;
+	unsigned char second;
+	BlockHandler handler;
+};
+
+static const Superinstruction superinstructions[] = {
+	{0x05, 0x20, decJumpFused<0>}, // DEC B; JR NZ, e
+	{0x0D, 0x20, decJumpFused<1>}, // DEC C; JR NZ, e
+	{0x15, 0x20, decJumpFused<2>}, // DEC D; JR NZ, e
+	{0x1D, 0x20, decJumpFused<3>}, // DEC E; JR NZ, e
+	{0x3D, 0x20, decJumpFused<7>}, // DEC A; JR NZ, e
+	{0x2A, 0x12, copyIncFused}, // LD A, (HL+); LD (DE), A
+	{0x1A, 0x22, copyToIncFused}, // LD A, (DE); LD (HL+), A
+	{0x13, 0x0B, incDecBCFused<1>}, // INC DE; DEC BC
+	{0x23, 0x0B, incDecBCFused<2>}, // INC HL; DEC BC
+	{0x78, 0xB1, testBCFused}, // LD A, B; OR C
+};
+
+struct BlockOp {
+	BlockHandler handler; // Exact: leaves F as stepping would
+	BlockHandler fast; // handler, or its flags-dead variant if none of the flags it writes are live
+	unsigned short opcode; // 0xCB00 | n for prefixed opcodes
+	unsigned char live; // Flags read before being overwritten after this instruction (all on exit)
+	bool check; // The block may have to stop after this instruction even on the fast path
+};
+
+/**
+ * Instruction (or fused pair) of a block's fast path.
+ */
+struct FastOp {
+	BlockHandler handler;
+	unsigned short opcode;
+	bool check; // As BlockOp::check, of its last instruction
+	unsigned char index; // Of its first instruction in Block::ops
+};
+
+/**
+ * Guest copy and fill loops run in bulk by runLoop(). The counter is B or BC, 0 meaning 256 or 65536.
+ */
+enum LOOP_KIND {
+	NO_LOOP,
+	COPY_B, // LD A, (HL+); LD (DE), A; INC DE; DEC B; JR NZ, loop
+	COPY_BC, // LD A, (HL+); LD (DE), A; INC DE; DEC BC; LD A, B; OR C; JR NZ, loop
+	FILL_B, // LD (HL+), A; DEC B; JR NZ, loop
+	FILL_BC // LD A, E; LD (HL+), A; DEC BC; LD A, B; OR C; JR NZ, loop
+};
+
+struct LoopShape {
+	LOOP_KIND kind;
+	size_t length;
+	unsigned char opcodes[7];
+};
+
+static const LoopShape loopShapes[] = {
+	{COPY_B, 5, {0x2A, 0x12, 0x13, 0x05, 0x20}},
+	{COPY_BC, 7, {0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20}},
+	{FILL_B, 3, {0x22, 0x05, 0x20}},
+	{FILL_BC, 6, {0x7B, 0x22, 0x0B, 0x78, 0xB1, 0x20}}, // Not LD A, u8, which leaves A alone in this core
+};
+
+/**
+ * Block of a recompiled ROM (see src/tools/recompile.cpp): runs the block as the fast path would,
+ * stopping after any instruction that needs a check where compiledStops(), and returns the number
+ * of instructions run.
+ */
+typedef unsigned char (*CompiledBlock)(CPU &cpu);
+
+struct CompiledEntry {
+	unsigned key; // codeKey() of the block
+	CompiledBlock run;
+};
+
+/**
+ * What a recompiled ROM plugin exports, through `extern "C" const CompiledROM *gbCompiledROM()`.
+ */
+struct CompiledROM {
+	unsigned long long romHash; // romHash() of the ROM it was compiled from
+	size_t count;
+	const CompiledEntry *entries;
+};
+
+/**
+ * FNV-1a hash of a ROM image.
+ */
+inline unsigned long long romHash(const unsigned char *rom, unsigned long size){
+	unsigned long long hash = 0xCBF29CE484222325;
+	for (unsigned long i = 0; i < size; i++){
+		hash = (hash ^ rom[i]) * 0x100000001B3;
+	}
+	return hash;
+}
+
+/**
+ * The fast path's stop check, for compiled blocks entered with `bank` mapped: a fault, a bank switch
+ * under a banked block, an interrupt to enter or OAM DMA taking the bus.
+ */
+inline bool compiledStops(const CPU &cpu, bool banked, unsigned short bank){
+	return cpu.fault || (banked && cpu.memory.bank != bank) || (cpu.ime && cpu.pendingInterrupts()) || cpu.memory.dma;
+}
+
+/**
+ * Straight-line run of cartridge ROM instructions, ending after the first control flow instruction
+ * (or HALT, STOP, EI, DI, an undefined opcode, the end of its 16KB bank or `maxOps` instructions).
+ */
+struct Block {
+	unsigned short start;
+	unsigned short end; // Address after the last instruction
+	bool banked; // In 0x4000-0x7FFF, only valid while that bank stays mapped
+	unsigned char exit; // CALL_KIND of the last instruction
+	unsigned maxCycles; // Upper bound of the cycles running the whole block takes
+	std::vector<BlockOp> ops; // One per instruction
+	std::vector<FastOp> fastOps; // ops with flags-dead variants and superinstructions, for the fast path
+	Block *returnBlock; // Block at `end`, where a call made by this block returns to; resolved on first use
+	unsigned returnKey; // codeKey() returnBlock was resolved for (`end` may be in the switchable bank)
+	Block *successors[2]; // Last block that followed when the exit was taken / fell through
+	unsigned successorKeys[2];
+	unsigned char loop; // LOOP_KIND, if the block is one of those loops jumping back to its own start
+	unsigned loopCycles; // Cycles of one iteration that jumps back
+	CompiledBlock compiled; // Replaces fastOps if the ROM was recompiled, nullptr otherwise
+	bool ram; // At 0x8000 or above, only valid while its code stays the same (see BlockCache::stale())
+	unsigned long long incarnation; // Memory::incarnation and the generations of its first and last page
+	unsigned generations[2]; // when its code was last known to be current
+	std::vector<unsigned char> code; // Its bytes, if in RAM
+};
+
+/**
+ * Decoded basic blocks of one cartridge, keyed by codeKey(), plus a shadow return-address stack:
+ * every call that leaves a block pushes the block, so the matching RET continues at the block after
+ * the call site without looking it up. The stack is only a prediction, a RET that doesn't land
+ * where the top entry expects (the routine popped or rewrote its return address) falls back to the
+ * lookup, and so does one that finds the stack empty.
+ *
+ * ROM never changes, so its blocks stay valid as long as the cartridge does. Blocks in RAM (code
+ * copied to WRAM or HRAM, such as OAM DMA routines, and self-modifying code) remember the
+ * generations of their pages (Memory::generations): while those are unchanged the block is
+ * current, otherwise its bytes are compared and it is decoded again only if they differ (stale()).
+ * Not thread safe, use one per thread (emulators on one thread can share it).
+ * Attach to an emulator through Emulator::blocks.
+ */
+class BlockCache {
+public:
+	static const size_t maxOps = 64;
+	static const unsigned returnDepth = 32; // Deeper calls overwrite the oldest entries
+
+	unsigned long long lookups; // Hash lookups for the next block, the rest followed a link
+	unsigned long long returns; // Returns taken from a block
+	unsigned long long returnHits; // Returns predicted by the shadow stack
+	unsigned long long loopIterations; // Loop iterations run in bulk by runLoop()
+	unsigned long long invalidations; // RAM blocks decoded again because their code changed
+
+	BlockCache();
+
+	void reset();
+	void clearFusions();
+	bool enableFusion(unsigned char first, unsigned char second);
+	bool loadFusions(const char *path);
+	Block *lookup(Memory &memory, unsigned short pc);
+	Block *lookupKey(Memory &memory, unsigned key);
+	size_t attach(const CompiledROM &compiled, Memory &memory);
+	Block *next(Block &block, CPU &cpu);
+	bool stale(Block &block, const Memory &memory);
+	Block *refresh(Block &block, Memory &memory);
+	inline size_t size() const { return blocks.size(); }
+
+private:
+	std::unordered_map<unsigned, Block> blocks; // Nodes never move, so Block pointers stay valid
+	Block *callers[returnDepth]; // Shadow return-address stack, as a ring
+	unsigned depth;
+	std::unordered_map<unsigned short, BlockHandler> fusions; // Enabled superinstructions by first << 8 | second
+
+	Block *followCall(Block &block, CPU &cpu, bool fallthrough);
+	void decode(Block &block, Memory &memory, unsigned short pc);
+};
+
+/**
+ * \return true if `opcode` isn't an instruction of the Game Boy CPU.
+ */
+inline bool undefinedOpcode(unsigned char opcode){
+	switch (opcode){
+		case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * \return true if a block can't continue after `opcode`.
+ */
+inline bool endsBlock(unsigned char opcode){
+	switch (opcode){
+		case 0x10: // STOP
+		case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+		case 0x76: // HALT
+		case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // JP
+		case 0xD9: // RETI
+		case 0xF3: case 0xFB: // DI, EI
+			return true;
+		default:
+			return undefinedOpcode(opcode) || callKinds[opcode] != NO_CALL;
+	}
+}
+
+/**
+ * \return true if a block may have to stop after `opcode` for a reason other than time passing:
+ * it writes memory (which includes IF, IE and the MBC) or may fault.
+ */
+inline bool checkAfter(unsigned char opcode){
+	switch (opcode){
+		case 0x02: case 0x12: case 0x22: case 0x32: case 0x08: // LD (dd), A / LD (u16), SP
+		case 0x34: case 0x35: case 0x36: // INC/DEC (HL), LD (HL), u8
+		case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x77: // LD (HL), r
+		case 0xE0: case 0xE2: case 0xEA: // LDH (u8), A / LD (C), A / LD (u16), A
+		case 0xC5: case 0xD5: case 0xE5: case 0xF5: // PUSH
+		case 0xCB:
+			return true;
+		default:
+			return endsBlock(opcode);
+	}
+}
+
+/**
+ * Starts out empty, with every superinstruction enabled.
+ */
+BlockCache::BlockCache(){
+	reset();
+	for (const Superinstruction &fused : superinstructions){
+		enableFusion(fused.first, fused.second);
+	}
+}
+
+/**
+ * Forgets every block, for a different cartridge.
+ */
+void BlockCache::reset(){
+	blocks.clear();
+	depth = 0;
+	lookups = 0;
+	returns = 0;
+	returnHits = 0;
+	loopIterations = 0;
+	invalidations = 0;
+}
+
+/**
+ * Disables every superinstruction. Changes to the set only apply to blocks decoded afterwards,
+ * so make them before running (or reset()).
+ */
+void BlockCache::clearFusions(){
+	fusions.clear();
+}
+
+/**
+ * \return false if there's no superinstruction for the pair.
+ */
+bool BlockCache::enableFusion(unsigned char first, unsigned char second){
+	for (const Superinstruction &fused : superinstructions){
+		if (fused.first == first && fused.second == second){
+			fusions[first << 8 | second] = fused.handler;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Enables only the superinstructions for the pairs listed in `path`, as in the profile.pairs a
+ * profiling build writes for the game ("first second count" hex opcode lines, ';' starts a
+ * comment). Pairs without a superinstruction are skipped.
+ * \return false if the file can't be read.
+ */
+bool BlockCache::loadFusions(const char *path){
+	std::ifstream file(path);
+	if (!file){
+		return false;
+	}
+	clearFusions();
+	std::string line;
+	while (std::getline(file, line)){
+		line = line.substr(0, line.find(';'));
+		unsigned first, second;
+		if (sscanf(line.c_str(), "%x %x", &first, &second) == 2 && first <= 0xFF && second <= 0xFF){
+			enableFusion(first, second);
+		}
+	}
+	return true;
+}
+
+/**
+ * \return the block starting at `pc` in the mapped bank, decoding it on first use,
+ * or nullptr if `pc` isn't in cartridge ROM or OAM DMA holds the bus (nothing is decoded then, the
+ * CPU would read 0xFF from the code).
+ */
+Block *BlockCache::lookup(Memory &memory, unsigned short pc){
+	if (!memory.rom || memory.dma || (pc >= 0xFF00 && pc < 0xFF80)){ // Nor the IO registers
+		return nullptr;
+	}
+	lookups++;
+	unsigned key = codeKey(pc, memory.bank);
+	auto found = blocks.find(key);
+	if (found == blocks.end()){
+		found = blocks.emplace(key, Block()).first;
+		decode(found->second, memory, pc);
+	}
+	return found->second.ops.empty()? nullptr:&found->second;
+}
+
+/**
+ * lookup() of code key `key`, with its bank mapped in `memory` meanwhile.
+ * \return nullptr if that bank isn't part of the ROM, as lookup() otherwise.
+ */
+Block *BlockCache::lookupKey(Memory &memory, unsigned key){
+	if (key < 0x10000){
+		return lookup(memory, key);
+	}
+	unsigned short bank = (key - 0x10000) / 0x4000;
+	unsigned short mapped = memory.bank;
+	if (!memory.rom || (bank + 1) * 0x4000UL > memory.romSize){
+		return nullptr;
+	}
+	if (bank != mapped){
+		memory.bank = bank;
+		memory.mapPages();
+	}
+	Block *block = lookup(memory, 0x4000 + (key - 0x10000) % 0x4000);
+	if (bank != mapped){
+		memory.bank = mapped;
+		memory.mapPages();
+	}
+	return block;
+}
+
+/**
+ * Decodes the blocks of a recompiled ROM and has the fast path run their compiled code.
+ * \return the number of blocks attached, 0 if `compiled` is of a different ROM than the one `memory` maps.
+ */
+size_t BlockCache::attach(const CompiledROM &compiled, Memory &memory){
+	if (!memory.rom || compiled.romHash != romHash(memory.rom, memory.romSize)){
+		return 0;
+	}
+	unsigned long long counted = lookups;
+	size_t attached = 0;
+	for (size_t i = 0; i < compiled.count; i++){
+		Block *block = lookupKey(memory, compiled.entries[i].key);
+		if (block){
+			block->compiled = compiled.entries[i].run;
+			attached++;
+		}
+	}
+	lookups = counted; // Count only lookups made running
+	return attached;
+}
+
+/**
+ * Follows the exit of `block`, which `cpu` just ran to the end: through the shadow stack for a
+ * return, otherwise through the link to the block that followed last time.
+ * \return the block to run next, nullptr if PC left cartridge ROM.
+ */
+inline Block *BlockCache::next(Block &block, CPU &cpu){
+	bool fallthrough = cpu.PC == block.end;
+	if (block.exit != NO_CALL){
+		Block *predicted = followCall(block, cpu, fallthrough);
+		if (predicted){
+			return predicted;
+		}
+	}
+	unsigned key = codeKey(cpu.PC, cpu.memory.bank);
+	if (!block.successors[fallthrough] || block.successorKeys[fallthrough] != key){
+		block.successors[fallthrough] = lookup(cpu.memory, cpu.PC);
+		block.successorKeys[fallthrough] = key;
+	}
+	return block.successors[fallthrough];
+}
+
+/**
+ * Pushes a call taken at the end of `block` on the shadow stack, or pops the caller for a return.
+ * \return the block after the caller's call site if the return went there, else nullptr.
+ */
+Block *BlockCache::followCall(Block &block, CPU &cpu, bool fallthrough){
+	switch (block.exit){
+		case CALL: case CALL_CC: case RST:
+			if (!fallthrough || block.exit == RST){
+				callers[depth++ % returnDepth] = &block;
+			}
+			break;
+		case RET: case RET_CC:
+			if (fallthrough && block.exit == RET_CC){
+				break;
+			}
+			returns++;
+			if (depth){
+				Block *caller = callers[--depth % returnDepth];
+				if (caller->end == cpu.PC){
+					unsigned key = codeKey(cpu.PC, cpu.memory.bank);
+					if (caller->returnBlock && caller->returnKey == key){
+						returnHits++;
+						return caller->returnBlock;
+					}
+					caller->returnBlock = lookup(cpu.memory, cpu.PC);
+					caller->returnKey = key;
+					return caller->returnBlock;
+				}
+			}
+			break;
+	}
+	return nullptr;
+}
+
+/**
+ * \return true if RAM block `block` no longer matches the code in `memory`. Pages written since
+ * the block was last current only make it compare its bytes, if they're the same it's current again.
+ */
+inline bool BlockCache::stale(Block &block, const Memory &memory){
+	unsigned first = memory.generations[block.start >> 8];
+	unsigned last = memory.generations[(block.end - 1) >> 8];
+	if (block.incarnation == memory.incarnation && block.generations[0] == first && block.generations[1] == last){
+		return false;
+	}
+	unsigned short addr = block.start;
+	for (unsigned char byte : block.code){
+		if (memory.pages[addr >> 8][addr & 0xFF] != byte){
+			return true;
+		}
+		addr++;
+	}
+	block.incarnation = memory.incarnation;
+	block.generations[0] = first;
+	block.generations[1] = last;
+	return false;
+}
+
+/**
+ * \return RAM block `block`, decoded again first if it's stale(), or nullptr if no instruction can
+ * be decoded there anymore or OAM DMA holds the bus (the block is left as it is).
+ */
+Block *BlockCache::refresh(Block &block, Memory &memory){
+	if (memory.dma){
+		return nullptr;
+	}
+	if (stale(block, memory)){
+		invalidations++;
+		block.ops.clear();
+		block.fastOps.clear();
+		decode(block, memory, block.start);
+	}
+	return block.ops.empty()? nullptr:&block;
+}
+
+/**
+ * Decodes the block at `pc`, then walks it backwards to find the flags live after every
+ * instruction. Every flag counts as live on exit and after instructions the block may stop at
+ * (checkAfter()), so F is exact wherever it can be observed. The fast path then gets the
+ * flags-dead variants and the enabled superinstructions.
+ */
+void BlockCache::decode(Block &block, Memory &memory, unsigned short pc){
+	unsigned limit = (pc < 0x4000)? 0x4000:(pc < 0x8000)? 0x8000:(pc < 0xFF00)? 0xFF00:0xFFFF; // Bank 0 and the switchable bank aren't contiguous, IO and IE aren't code
+	block.start = pc;
+	block.banked = pc >= 0x4000 && pc < 0x8000;
+	block.ram = pc >= 0x8000;
+	block.exit = NO_CALL;
+	block.maxCycles = 12; // Taken branch of a conditional last instruction
+	block.returnBlock = nullptr;
+	block.returnKey = 0;
+	block.successors[0] = block.successors[1] = nullptr;
+	block.successorKeys[0] = block.successorKeys[1] = 0;
+	block.compiled = nullptr;
+	while (block.ops.size() < maxOps){
+		unsigned char opcode = memory[pc];
+		if (pc + opcodeLengths[opcode] > limit){
+			break;
+		}
+		unsigned short prefixed = (opcode == 0xCB)? 0xCB00 | memory[pc + 1]:opcode;
+		block.ops.push_back({interpretOpcode, interpretOpcode, prefixed, allFlags, checkAfter(opcode)});
+		block.exit = callKinds[opcode];
+		block.maxCycles += (opcode == 0xCB)? 16:opcodeCycles[opcode];
+		pc += opcodeLengths[opcode];
+		if (endsBlock(opcode)){
+			break;
+		}
+	}
+	block.end = pc;
+
+	unsigned char live = allFlags;
+	for (size_t i = block.ops.size(); i-- > 0;){
+		BlockOp &op = block.ops[i];
+		unsigned char opcode = (op.opcode > 0xFF)? 0xCB:op.opcode;
+		if (op.check){
+			live = allFlags;
+		}
+		op.live = live;
+		if (!(flagEffects.written[opcode] & live) && deadFlagsHandlers[opcode]){
+			op.fast = deadFlagsHandlers[opcode];
+		}
+		live = (live & ~flagEffects.written[opcode]) | flagEffects.read[opcode];
+	}
+
+	for (size_t i = 0; i < block.ops.size(); i++){
+		const BlockOp &op = block.ops[i];
+		if (i + 1 < block.ops.size() && !op.check){ // The fast path can't stop inside a pair
+			auto fused = fusions.find(op.opcode << 8 | block.ops[i + 1].opcode);
+			if (op.opcode <= 0xFF && block.ops[i + 1].opcode <= 0xFF && fused != fusions.end()){
+				block.fastOps.push_back({fused->second, op.opcode, block.ops[i + 1].check, (unsigned char)i});
+				i++;
+				continue;
+			}
+		}
+		block.fastOps.push_back({op.fast, op.opcode, op.check, (unsigned char)i});
+	}
+
+	block.code.clear();
+	if (block.ram){
+		for (unsigned short addr = block.start; addr != block.end; addr++){
+			block.code.push_back(memory[addr]);
+		}
+		block.incarnation = memory.incarnation;
+		block.generations[0] = memory.generations[block.start >> 8];
+		block.generations[1] = memory.generations[(block.end - 1) >> 8];
+	}
+
+	block.loop = NO_LOOP;
+	block.loopCycles = block.maxCycles - 8; // Less the 12 a taken JR is counted for, plus its 4 extra
+	signed char e = memory[block.end - 1]; // Not RAM blocks, a bulk copy could overwrite their code
+	for (const LoopShape &shape : loopShapes){
+		bool matches = !block.ram && shape.length == block.ops.size() && (unsigned short)(block.end + e) == block.start;
+		for (size_t i = 0; matches && i < shape.length; i++){
+			matches = block.ops[i].opcode == shape.opcodes[i];
+		}
+		if (matches){
+			block.loop = shape.kind;
+		}
+	}
+}
+
+/**
+ * \return true if [addr, addr + length) is plain memory: ROM or RAM below the IO registers,
+ * with no MBC writes, MMIO or wrapping around the address space.
+ */
+inline bool plainMemory(unsigned addr, unsigned length, bool written){
+	return (!written || addr >= 0x8000) && addr + length <= 0xFF00;
+}
+
+/**
+ * Runs as many whole iterations of loop `block` (at cpu.PC == block.start) as fit in under
+ * `horizon` cycles at once, with host memcpy/memset. Registers, flags, memory, cycles and `opcode`
+ * come out exactly as stepping would leave them, with PC back at the start or past the loop if it
+ * finished. The caller ticks the PPU and must bound `horizon` so that nothing can stop stepping
+ * before then.
+ *
+ * \return the number of iterations run, 0 when the loop has to be stepped: too little time left,
+ * source or destination overlap or aren't plain memory.
+ */
+inline unsigned runLoop(const Block &block, CPU &cpu, unsigned long long horizon){
+	bool wide = block.loop == COPY_BC || block.loop == FILL_BC;
+	unsigned remaining = wide? (cpu.BC? cpu.BC:0x10000):(cpu.B()? cpu.B():0x100);
+	unsigned iterations = (unsigned)std::min<unsigned long long>(remaining, horizon? (horizon - 1) / block.loopCycles:0);
+	if (!iterations){
+		return 0;
+	}
+	if (block.loop == COPY_B || block.loop == COPY_BC){
+		unsigned src = cpu.HL;
+		unsigned dst = cpu.DE;
+		if (!plainMemory(src, iterations, false) || !plainMemory(dst, iterations, true) || (src < dst + iterations && dst < src + iterations)){
+			return 0;
+		}
+		cpu.memory.copy(dst, src, iterations);
+		cpu.AF = (cpu.AF & 0x00FF) | cpu.memory[src + iterations - 1] << 8;
+		cpu.DE += iterations;
+	} else {
+		unsigned dst = cpu.HL;
+		if (!plainMemory(dst, iterations, true)){
+			return 0;
+		}
+		if (block.loop == FILL_BC){
+			cpu.AF = (cpu.AF & 0x00FF) | cpu.E() << 8;
+		}
+		cpu.memory.fill(dst, cpu.A(), iterations);
+	}
+	cpu.HL += iterations;
+	if (wide){
+		cpu.BC -= iterations;
+		cpu.AF = aluOr((cpu.AF & 0x00FF) | (cpu.BC & 0xFF00), cpu.C());
+	} else {
+		cpu.BC -= iterations << 8;
+		cpu.AF = (cpu.AF & (0xFF00 | cFlag)) | flagTables.dec[cpu.B()];
+	}
+	bool finished = iterations == remaining;
+	cpu.PC = finished? block.end:block.start;
+	cpu.cycles += (unsigned long long)iterations * block.loopCycles - (finished? 4:0);
+	cpu.opcode = 0x20;
+	return iterations;
+}
+
+#endif
@@ -3,7 +3,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <array>
 #include <cstdlib>
+#include <utility>
+#include "Memory.hpp"
 
 /*
 FLAGS REGISTER FOR LOWER 8 BITS OF AF.
@@ -27,13 +30,274 @@ enum MODE {HIGH, LOW, PAIR};
 
 enum DIRECTION {LEFT, RIGHT};
 
+/**
+ * Addresses of the memory mapped IO registers.
+ */
+enum IO_REGISTER {
+	P1 = 0xFF00, // Joypad
+	IF = 0xFF0F, // Interrupt flags
+	LCDC = 0xFF40, // LCD control
+	STAT = 0xFF41, // LCD status
+	SCY = 0xFF42, // Background scroll Y
+	SCX = 0xFF43, // Background scroll X
+	LY = 0xFF44, // Current scanline
+	LYC = 0xFF45, // Scanline compare
+	DMA = 0xFF46, // OAM DMA source page
+	BGP = 0xFF47, // Background palette
+	IE = 0xFFFF // Interrupt enable
+};
+
+/**
+ * Base T-cycle cost of every unprefixed opcode.
+ * Conditional jumps/calls/returns are listed at their not-taken cost; the extra cycles
+ * are added by the opcode when the branch is taken.
+ */
+static const unsigned char opcodeCycles[256] = {
+	 4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4, // 0x0*
+	 4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4, // 0x1*
+	 8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4, // 0x2*
+	 8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4, // 0x3*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0x4*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0x5*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0x6*
+	 8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, // 0x7*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0x8*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0x9*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0xA*
+	 4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4, // 0xB*
+	 8,12,12,16,12,16, 8,16, 8,16,12, 4,12,24, 8,16, // 0xC*
+	 8,12,12, 4,12,16, 8,16, 8,16,12, 4,12, 4, 8,16, // 0xD*
+	12,12, 8, 4, 4,16, 8,16,16, 4,16, 4, 4, 4, 8,16, // 0xE*
+	12,12, 8, 4, 4,16, 8,16,12, 8,16, 4, 4, 4, 8,16  // 0xF*
+};
+
+/**
+ * Instruction length in bytes, including the operands (and the 0xCB prefix).
+ */
+static const unsigned char opcodeLengths[256] = {
+	1,3,1,1,1,1,2,1,3,1,1,1,1,1,2,1, // 0x0*
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1, // 0x1*
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1, // 0x2*
+	2,3,1,1,1,1,2,1,2,1,1,1,1,1,2,1, // 0x3*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x4*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x5*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x6*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x7*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x8*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x9*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0xA*
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0xB*
+	1,1,3,3,3,1,2,1,1,1,3,2,3,3,2,1, // 0xC*
+	1,1,3,1,3,1,2,1,1,1,3,1,3,1,2,1, // 0xD*
+	2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1, // 0xE*
+	2,1,1,1,1,1,2,1,2,1,3,1,1,1,2,1  // 0xF*
+};
+
+/**
+ * Flags of the 8-bit operations, looked up by result instead of worked out with branches.
+ * add and sub are indexed by the 9-bit result, bit 8 being the carry (borrow) out, so carry-in is
+ * already accounted for. H depends on the operands rather than the result and comes from
+ * halfCarry().
+ */
+struct FlagTables {
+	unsigned char inc[256]; // INC: Z, H (C is kept)
+	unsigned char dec[256]; // DEC: Z, N, H (C is kept)
+	unsigned char add[512]; // ADD/ADC: Z, C
+	unsigned char sub[512]; // SUB/SBC/CP: Z, N, C
+	unsigned char logic[256]; // XOR/OR: Z (AND also sets H)
+};
+
+constexpr FlagTables makeFlagTables(){
+	FlagTables tables = {};
+	for (int r = 0; r < 512; r++){
+		unsigned char z = (r & 0xFF)? 0:zFlag;
+		unsigned char c = (r & 0x100)? cFlag:0;
+		tables.add[r] = z | c;
+		tables.sub[r] = z | nFlag | c;
+		if (r < 256){
+			tables.inc[r] = z | (((r & 0x0F) == 0x00)? hFlag:0);
+			tables.dec[r] = z | nFlag | (((r & 0x0F) == 0x0F)? hFlag:0);
+			tables.logic[r] = z;
+		}
+	}
+	return tables;
+}
+
+static constexpr FlagTables flagTables = makeFlagTables();
+
+/**
+ * H flag of `a` + `b` (or `a` - `b`) giving `result`, carry-in included: bit 4 of the result
+ * differs from the sum of the operands' bit 4 exactly when the low nibbles carried (borrowed).
+ */
+inline unsigned char halfCarry(unsigned a, unsigned b, unsigned result){
+	return ((a ^ b ^ result) & 0x10) << 1;
+}
+
+/**
+ * AF after DAA for every A and N/H/C, indexed by A << 3 | N << 2 | H << 1 | C.
+ */
+struct DaaTable {
+	unsigned short af[2048];
+};
+
+constexpr DaaTable makeDaaTable(){
+	DaaTable table = {};
+	for (int i = 0; i < 2048; i++){
+		unsigned char a = i >> 3;
+		bool n = i & 4, h = i & 2, c = i & 1;
+		if (!n){ // After an addition: correct digits above 9
+			if (c || a > 0x99){
+				a += 0x60;
+				c = true;
+			}
+			if (h || (a & 0x0F) > 0x09){
+				a += 0x06;
+			}
+		} else { // After a subtraction: only undo the borrows
+			if (c) a -= 0x60;
+			if (h) a -= 0x06;
+		}
+		table.af[i] = a << 8 | (a? 0:zFlag) | (n? nFlag:0) | (c? cFlag:0);
+	}
+	return table;
+}
+
+static constexpr DaaTable daaTable = makeDaaTable();
+
+/**
+ * `opcode` after a step that entered an interrupt handler instead of executing an instruction;
+ * the low byte is the handler's address.
+ */
+#define INTERRUPT_ENTRY	0xFF00
+
+/**
+ * ALU_OP is `y` of the 0x80-0xBF block and of the immediate forms 0xC6-0xFE.
+ */
+enum ALU_OP {ADD, ADC, SUB, SBC, AND, XOR, OR, CP};
+
+/*
+8-bit ALU kernels: each takes AF and the operand and returns the new AF, without branches.
+They only depend on their arguments so the block decoder and the lockstep engine can use them too.
+*/
+inline unsigned short aluAdd(unsigned short af, unsigned char b, unsigned carry){
+	unsigned a = af >> 8;
+	unsigned r = a + b + carry;
+	return (r & 0xFF) << 8 | flagTables.add[r] | halfCarry(a, b, r);
+}
+
+inline unsigned short aluSub(unsigned short af, unsigned char b, unsigned carry){
+	unsigned a = af >> 8;
+	unsigned r = (a - b - carry) & 0x1FF; // Bit 8 set on a borrow
+	return (r & 0xFF) << 8 | flagTables.sub[r] | halfCarry(a, b, r);
+}
+
+inline unsigned short aluAnd(unsigned short af, unsigned char b){
+	unsigned r = (af >> 8) & b;
+	return r << 8 | flagTables.logic[r] | hFlag;
+}
+
+inline unsigned short aluXor(unsigned short af, unsigned char b){
+	unsigned r = (af >> 8) ^ b;
+	return r << 8 | flagTables.logic[r];
+}
+
+inline unsigned short aluOr(unsigned short af, unsigned char b){
+	unsigned r = (af >> 8) | b;
+	return r << 8 | flagTables.logic[r];
+}
+
+inline unsigned short aluCp(unsigned short af, unsigned char b){
+	return (af & 0xFF00) | (aluSub(af, b, 0) & 0x00FF); // SUB that only keeps the flags
+}
+
+/**
+ * Runs ALU operation `op` on A and `value`.
+ * \return the new AF.
+ */
+inline unsigned short alu(unsigned char op, unsigned short af, unsigned char value){
+	unsigned carry = (af & cFlag) >> 4;
+	switch (op){
+		case ADD: return aluAdd(af, value, 0);
+		case ADC: return aluAdd(af, value, carry);
+		case SUB: return aluSub(af, value, 0);
+		case SBC: return aluSub(af, value, carry);
+		case AND: return aluAnd(af, value);
+		case XOR: return aluXor(af, value);
+		case OR: return aluOr(af, value);
+		default: return aluCp(af, value);
+	}
+}
+
+/**
+ * F bits each opcode reads, and F bits it always overwrites with a value that doesn't depend on
+ * their old one, as this CPU implements the opcodes (0x0F-0x3F rotate right). The block decoder's
+ * flag liveness pass relies on them, so they err towards reading: prefixed (0xCB) and undefined
+ * opcodes read every flag.
+ */
+struct FlagEffects {
+	unsigned char read[256];
+	unsigned char written[256];
+};
+
+#define allFlags	(zFlag | nFlag | hFlag | cFlag)
+
+constexpr FlagEffects makeFlagEffects(){
+	FlagEffects effects = {};
+	for (int op = 0; op < 256; op++){
+		int x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+		unsigned char ccFlag = (y & 0b10)? cFlag:zFlag; // Flag tested by condition cc = y & 3
+		unsigned char &read = effects.read[op];
+		unsigned char &written = effects.written[op];
+		if (x == 0){
+			if (z == 4 || z == 5){ // INC/DEC r
+				written = zFlag | nFlag | hFlag;
+			} else if ((op & 0x0F) == 0x09){ // ADD HL, dd
+				written = nFlag | hFlag | cFlag;
+			} else if (z == 0 && y >= 4){ // JR cc
+				read = ccFlag;
+			} else if (z == 7){
+				switch (y){
+					case 2: read = cFlag; written = allFlags; break; // RLA
+					case 4: read = nFlag | hFlag | cFlag; written = zFlag | hFlag; break; // DAA
+					case 6: written = nFlag | hFlag | cFlag; break; // SCF
+					default: written = allFlags; break; // Rotates
+				}
+			}
+		} else if (x == 2 || (x == 3 && z == 6)){ // ALU A, r / ALU A, u8
+			written = allFlags;
+			read = (y == ADC || y == SBC)? cFlag:0;
+		} else if (x == 3){
+			switch (op){
+				case 0xE8: case 0xF8: case 0xF1: written = allFlags; break; // ADD SP, e / LD HL, SP + e / POP AF
+				case 0xF5: case 0xCB: read = allFlags; break; // PUSH AF, prefixed opcodes
+				case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+					read = allFlags;
+					break;
+				default:
+					if (y < 4 && (z == 0 || z == 2 || z == 4)){ // RET cc / JP cc / CALL cc
+						read = ccFlag;
+					}
+					break;
+			}
+		}
+	}
+	return effects;
+}
+
+static constexpr FlagEffects flagEffects = makeFlagEffects();
+
 class CPU {
 public:
-	// Registers
-	unsigned short AF; // Accumulator & flags
-	unsigned short BC; // BC
-	unsigned short DE; // DE
-	unsigned short HL; // HL
+	// Registers, also addressable as bytes (see reg8Offsets)
+	union {
+		struct {
+			unsigned short AF; // Accumulator & flags
+			unsigned short BC; // BC
+			unsigned short DE; // DE
+			unsigned short HL; // HL
+		};
+		unsigned char reg8[8];
+	};
 	unsigned short SP; // Stack pointer
 	unsigned short PC; // Program counter
 
@@ -48,21 +312,68 @@ public:
 	inline unsigned char L() const { return ( HL & 0x00FF);} // Lower register of HL (HL-)
 
 	// Memory
-	unsigned char memory[465535]; // 16 bit address bus
+	Memory memory; // 16 bit address bus
 
 	unsigned short opcode;
 
+	unsigned long long cycles; // T-cycles executed since initialize()
+	bool fault; // Set when an opcode that can't be decoded is hit, leaving PC and opcode on it
+	unsigned char buttons; // Pressed buttons (1 = pressed). 0-3: Right, Left, Up, Down | 4-7: A, B, Select, Start
+
+	bool ime; // Interrupt master enable
+	unsigned char eiDelay; // Steps until EI sets IME (it takes effect after the next instruction)
+	bool halted; // HALT: no instructions run until an enabled interrupt is requested
+	unsigned long long dmaEnd; // Cycle OAM DMA gives the bus back at (Emulator::execute() ends it), ~0 if it doesn't hold it
+
+	CPU() = default;
+	explicit CPU(PagePool *pool);
 	void initialize();
 
+	void step();
 	void executeOpcode(short opcode);
+	__attribute__((always_inline)) inline void executeInline(short opcode);
+	inline unsigned short immediate16() const;
+	void updateJoypad();
 	void loadReg(unsigned char high, unsigned char low, unsigned short &reg);
 	void storeReg(unsigned char reg, unsigned short loc);
 	void incReg(int amount, unsigned short &reg, MODE mode);
 	void incMem(int amount, unsigned short loc);
 	void rotate(unsigned short &regPair, bool carry, DIRECTION d, MODE mode);
 	void addPairs(unsigned short &storeReg, unsigned short &reg);
+	unsigned char operand(unsigned char r);
+	void push(unsigned short value);
+	unsigned short pop();
+	bool condition(unsigned char cc);
+	void dispatch(unsigned char pending);
+
+	/**
+	 * \return the requested and enabled interrupts (IF & IE).
+	 */
+	inline unsigned char pendingInterrupts() const {
+		const unsigned char *io = memory.pages[0xFF];
+		return io[IF & 0xFF] & io[IE & 0xFF] & 0x1F;
+	}
+
+	template <int DST, int SRC> void move();
+	typedef void (CPU::*Handler)();
+	static const std::array<Handler, 64> moves;
 };
 
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "CPU::reg8 assumes the low byte of each register pair comes first"
+#endif
+
+/**
+ * Offset in CPU::reg8 of each 8-bit operand as encoded in opcodes: B, C, D, E, H, L, (HL), A.
+ * (HL) has none.
+ */
+static const int reg8Offsets[8] = {3, 2, 5, 4, 7, 6, -1, 1};
+
+/**
+ * A CPU whose memory takes its pages from `pool` (see Memory::pool).
+ */
+CPU::CPU(PagePool *pool) : memory(pool){}
+
 void CPU::initialize(){
 	AF = 0;
 	BC = 0;
@@ -70,9 +381,65 @@ void CPU::initialize(){
 	HL = 0;
 	SP = 0;
 	PC = 0x00; // Stating point of ROM
+	cycles = 0;
+	fault = false;
+	buttons = 0;
+	ime = false;
+	eiDelay = 0;
+	halted = false;
+	dmaEnd = ~0ULL;
+	if (memory.dma){ // Its end was just forgotten
+		memory.endDMA();
+	}
 }
 
-void CPU::executeOpcode(short input){
+/**
+ * Enters the highest priority pending interrupt if IME is set, otherwise fetches the opcode at PC
+ * (including the 0xCB prefix) and executes it. While halted only time passes.
+ * Opcodes and operands are fetched straight through the page table (Memory::pages), which already
+ * holds a host pointer per page and is rebuilt on bank switches, OAM DMA and copy-on-write. Caching
+ * the current code page on top of it only adds a check to every fetch, and measured slower.
+ */
+void CPU::step(){
+	if (eiDelay && --eiDelay == 0){
+		ime = true;
+	}
+	if (ime || halted){
+		unsigned char pending = pendingInterrupts();
+		if (pending){
+			halted = false;
+			if (ime){
+				dispatch(pending);
+				return;
+			}
+		}
+		if (halted){
+			opcode = 0x76;
+			cycles += 4;
+			return;
+		}
+	}
+	unsigned char op = memory[PC];
+	if (op == 0xCB){
+		executeOpcode(0xCB00 | memory[(unsigned short)(PC + 1)]);
+	} else {
+		executeOpcode(op);
+	}
+}
+
+/**
+ * \return the 16-bit operand of the instruction at PC. Read straight from the page table, and only
+ * by the instructions that have one.
+ */
+inline unsigned short CPU::immediate16() const{
+	return memory.pages[(unsigned short)(PC + 1) >> 8][(PC + 1) & 0xFF] | memory.pages[(unsigned short)(PC + 2) >> 8][(PC + 2) & 0xFF] << 8;
+}
+
+/**
+ * Body of executeOpcode(), forced inline so that a caller passing a constant opcode (recompiled
+ * blocks, see src/tools/recompile.cpp) keeps only that opcode's path.
+ */
+inline void CPU::executeInline(short input){
 	opcode = input;
 
 	unsigned char x = (opcode & 0b11000000) >> 6; // 1st octal digit
@@ -83,17 +450,27 @@ void CPU::executeOpcode(short input){
 
 	switch(opcode & 0xFF00){
 		case 0x0000: // 8-bit opcodes
+			cycles += opcodeCycles[opcode];
 			if (opcode <= 0x3F){ // First 4 rows of opcodes
 				unsigned short *ddReg; // Register pair targets
 				switch (p) {
 					case 0b00: ddReg = &BC; break;
 					case 0b01: ddReg = &DE; break;
 					case 0b10: ddReg = &HL; break;
-					case 0b11: ddReg = &SP; break;
+					default: ddReg = &SP; break; // 0b11
 				}
 				switch(opcode & 0x000F){
-					case 0x00: PC++; break;
-					case 0x01: loadReg(memory[PC+2], memory[PC+1], *ddReg); PC+= 3; break;
+					case 0x00: {
+						signed char e = memory[PC + 1];
+						switch (p) {
+							case 0b00: PC++; break; // NOP
+							case 0b01: PC += 2; break; // STOP (low power mode isn't emulated)
+							case 0b10: if (!(AF & zFlag)) { PC += e; cycles += 4; } PC += 2; break;
+							case 0b11: if (!(AF & cFlag)) { PC += e; cycles += 4; } PC += 2; break;
+						}
+						break;
+					}
+					case 0x01: *ddReg = immediate16(); PC+= 3; break;
 					case 0x02: 
 						switch (opcode){
 							case 0x22: storeReg(A(), HL); incReg(1, HL, PAIR); break;
@@ -132,7 +509,7 @@ void CPU::executeOpcode(short input){
 						switch (p){
 							case 0b00: rotate(AF, false, LEFT, HIGH); PC++; break;
 							case 0b01: rotate(AF, true, LEFT, HIGH); PC++; break;
-							case 0b10: PC++; break; // DO WHEN FINISHED IMPLEMENTING ADD/SUB LOGIC
+							case 0b10: AF = daaTable.af[A() << 3 | (AF >> 4 & 0x07)]; PC++; break; // DAA
 							case 0b11: AF |= cFlag; AF &= ~(nFlag | hFlag); PC++; break; // Set carry flag | unset negative & HC flags
 						}
 						break;
@@ -141,8 +518,8 @@ void CPU::executeOpcode(short input){
 						switch (p) {
 							case 0b00: {storeReg((SP & 0x00FF), PC); storeReg(((SP & 0xFF00) >> 8), PC + 1); PC += 3; break;}
 							case 0b01: PC += e + 2; break;
-							case 0b10: PC += (((AF & zFlag) >> 7)? e: 0) + 2; break;
-							case 0b11: PC += (((AF & cFlag) >> 4)? e: 0) + 2; break;
+							case 0b10: if (AF & zFlag) { PC += e; cycles += 4; } PC += 2; break;
+							case 0b11: if (AF & cFlag) { PC += e; cycles += 4; } PC += 2; break;
 						}
 						break;
 					}
@@ -156,23 +533,147 @@ void CPU::executeOpcode(short input){
 						PC++;
 						break;
 					case 0x0B: incReg(-1, *ddReg, PAIR); PC++; break;
-					case 0x0C: incReg(1, BC, LOW); PC++; break;
-					case 0x0D: incReg(-1, BC, LOW); PC++; break;
+					case 0x0C: if (p == 0b11) incReg(1, AF, HIGH); else incReg(1, *ddReg, LOW); PC++; break; // INC C/E/L/A
+					case 0x0D: if (p == 0b11) incReg(-1, AF, HIGH); else incReg(-1, *ddReg, LOW); PC++; break; // DEC C/E/L/A
 					case 0x0E: loadReg(B(), memory[PC+1], BC); PC+=2; break;
 					case 0x0F: rotate(AF, true, RIGHT, HIGH); PC++; break;
-					default: printf("Unknown opcode: 0x%X\n", opcode); break;
+					default: fault = true; break;
+				}
+			} else if (x == 0b01){
+				if (opcode == 0x76){ // HALT
+					halted = true;
+				} else { // LD r, r'
+					(this->*moves[opcode & 0x3F])();
+				}
+				PC++;
+			} else if (x == 0b10){ // ALU A, r
+				AF = alu(y, AF, operand(z));
+				PC++;
+			} else { // Control flow, stack and high memory loads
+				unsigned short *qqReg; // Register pair targets of PUSH/POP
+				switch (p) {
+					case 0b00: qqReg = &BC; break;
+					case 0b01: qqReg = &DE; break;
+					case 0b10: qqReg = &HL; break;
+					default: qqReg = &AF; break; // 0b11
+				}
+				switch (z){
+					case 0b000:
+						switch (y){
+							case 4: storeReg(A(), 0xFF00 | memory[PC + 1]); PC += 2; break; // LDH (u8), A
+							case 6: loadReg(memory[0xFF00 | memory[PC + 1]], F(), AF); PC += 2; break; // LDH A, (u8)
+							case 5: case 7: { // ADD SP, e / LD HL, SP + e
+								signed char e = memory[PC + 1];
+								unsigned short sum = SP + e;
+								AF = (AF & 0xFF00) | halfCarry(SP, (unsigned char)e, sum) | ((SP ^ e ^ sum) & 0x100) >> 4;
+								if (y == 5) SP = sum; else HL = sum;
+								PC += 2;
+								break;
+							}
+							default: // RET cc
+								if (condition(y)){
+									PC = pop();
+									cycles += 12;
+								} else {
+									PC++;
+								}
+								break;
+						}
+						break;
+					case 0b001:
+						if (!q){ // POP qq
+							*qqReg = pop();
+							AF &= 0xFFF0; // The low nibble of F is always 0
+							PC++;
+						} else {
+							switch (p){
+								case 0b00: PC = pop(); break; // RET
+								case 0b01: PC = pop(); ime = true; break; // RETI
+								case 0b10: PC = HL; break; // JP HL
+								case 0b11: SP = HL; PC++; break; // LD SP, HL
+							}
+						}
+						break;
+					case 0b010:
+						switch (y){
+							case 4: storeReg(A(), 0xFF00 | C()); PC++; break; // LD (C), A
+							case 5: storeReg(A(), immediate16()); PC += 3; break; // LD (u16), A
+							case 6: loadReg(memory[0xFF00 | C()], F(), AF); PC++; break; // LD A, (C)
+							case 7: loadReg(memory[immediate16()], F(), AF); PC += 3; break; // LD A, (u16)
+							default: // JP cc, u16
+								if (condition(y)){
+									PC = immediate16();
+									cycles += 4;
+								} else {
+									PC += 3;
+								}
+								break;
+						}
+						break;
+					case 0b011:
+						switch (y){
+							case 0: PC = immediate16(); break; // JP u16
+							case 6: ime = false; eiDelay = 0; PC++; break; // DI
+							case 7: eiDelay = 2; PC++; break; // EI: IME is set once the next instruction ran
+							default: fault = true; break;
+						}
+						break;
+					case 0b100:
+						if (y < 4){ // CALL cc, u16
+							if (condition(y)){
+								unsigned short target = immediate16(); // Before the push, which may overwrite it
+								push(PC + 3);
+								PC = target;
+								cycles += 12;
+							} else {
+								PC += 3;
+							}
+						} else {
+							fault = true;
+						}
+						break;
+					case 0b101:
+						if (!q){ // PUSH qq
+							push(*qqReg);
+							PC++;
+						} else if (p == 0b00){ // CALL u16
+							unsigned short target = immediate16();
+							push(PC + 3);
+							PC = target;
+						} else {
+							fault = true;
+						}
+						break;
+					case 0b110: AF = alu(y, AF, memory[PC + 1]); PC += 2; break; // ALU A, u8
+					case 0b111: push(PC + 1); PC = y * 8; break; // RST
 				}
 			}
 			break;
 
 		case 0xCB00: // 16-bit opcodes
-
+			cycles += ((opcode & 0x07) == 0x06)? (((opcode & 0xC0) == 0x40)? 12:16):8;
+			fault = true;
 			break;
 
-		default: printf("Unknown opcode: 0x%X\n", opcode); break;	
+		default: fault = true; break;	
 	}
 }
 
+void CPU::executeOpcode(short input){
+	executeInline(input);
+}
+
+/**
+ * Refreshes the lower nibble of P1 from `buttons` and the group selected in bits 4-5 (0 = selected).
+ */
+void CPU::updateJoypad(){
+	unsigned char select = memory[P1] & 0x30;
+	unsigned char pressed = 0;
+	if (!(select & 0x10)) pressed |= buttons & 0x0F; // Directions
+	if (!(select & 0x20)) pressed |= buttons >> 4; // Actions
+	memory.write(P1, 0xC0 | select | (~pressed & 0x0F));
+}
+
 /**
  * Loads data into register.
  */
@@ -184,7 +685,16 @@ void CPU::loadReg(unsigned char high, unsigned char low, unsigned short &reg){
  * Stores register into memory.
  */
 void CPU::storeReg(unsigned char reg, unsigned short loc){
-	memory[loc] = reg;
+	if (loc < 0x8000 && memory.rom){ // ROM is read only, writes go to the MBC
+		memory.writeROM(loc, reg);
+		return;
+	}
+	memory.write(loc, reg);
+	if (loc == P1) updateJoypad(); // Only the select bits are writable
+	if (loc == DMA){ // 1 M-cycle to start, then 160 copying a byte each
+		memory.startDMA(reg);
+		dmaEnd = cycles + 644;
+	}
 }
 
 /**
@@ -196,26 +706,10 @@ void CPU::incReg(int amount, unsigned short &reg, MODE mode){
 		reg += amount;
 	} else {
 		int shift = (mode == HIGH)? 8:0; // Shift of 8 if on the higher bit; 0 otherwise
-		unsigned char halfReg = (reg >> shift) & 0x00FF; // Shifting register pair then masking the lower register to get the register
-		if (amount > 0){
-			if (halfReg == 0xFF) {
-				AF |= (zFlag | hFlag); // set zero / half carry
-			} else {
-				AF &= ~(zFlag | hFlag); // unset otherwise
-			}
-			AF &= ~nFlag; // Unset nFlag
-		} else {
-			AF &= ~ (zFlag | hFlag); // unset both flags temporarily
-			if (halfReg == 1){
-				AF |= zFlag;
-			} else  if (halfReg == 0){
-				AF |= hFlag;
-			}
-			AF |= nFlag; // set nFlag
-		}
-		halfReg += amount;
+		unsigned char halfReg = (reg >> shift) + amount; // Shifting register pair then truncating to the register
 		unsigned short mask = (mode == HIGH)? 0x00FF:0xFF00; // Mask for other register
 		reg = (halfReg << shift) | (reg & mask);
+		AF = (AF & (0xFF00 | cFlag)) | ((amount > 0)? flagTables.inc:flagTables.dec)[halfReg]; // After reg, which may be AF
 	}
 }
 
@@ -224,24 +718,76 @@ void CPU::incReg(int amount, unsigned short &reg, MODE mode){
  * Increments memory at location of register `loc`.
  */
 void CPU::incMem(int amount, unsigned short loc){
-	unsigned char &targetMem = memory[loc];
-	if (amount > 0){
-		if (targetMem == 0xFF) {
-			AF |= (zFlag | hFlag); // set zero / half carry
-		} else {
-			AF &= ~(zFlag | hFlag); // unset otherwise
-		}
-		AF &= ~nFlag; // Unset nFlag
+	unsigned char result = memory[loc] + amount;
+	AF = (AF & (0xFF00 | cFlag)) | ((amount > 0)? flagTables.inc:flagTables.dec)[result];
+	storeReg(result, loc);
+}
+
+/**
+ * Value of 8-bit operand `r` as encoded in opcodes: B, C, D, E, H, L, (HL), A.
+ */
+unsigned char CPU::operand(unsigned char r){
+	return (r == 6)? memory[HL]:reg8[reg8Offsets[r]];
+}
+
+/**
+ * LD r, r': copies operand `SRC` into operand `DST` (encoded as in CPU::operand).
+ */
+template <int DST, int SRC> void CPU::move(){
+	if constexpr (DST == 6 && SRC == 6){
+		// 0x76 is HALT, not a move
+	} else if constexpr (DST == 6){
+		storeReg(reg8[reg8Offsets[SRC]], HL);
+	} else if constexpr (SRC == 6){
+		reg8[reg8Offsets[DST]] = memory[HL];
 	} else {
-		AF &= ~ (zFlag | hFlag); // unset both flags temporarily
-		if (targetMem == 1){
-			AF |= zFlag;
-		} else  if (targetMem == 0){
-			AF |= hFlag;
-		}
-		AF |= nFlag; // set nFlag
+		reg8[reg8Offsets[DST]] = reg8[reg8Offsets[SRC]];
 	}
-	targetMem += amount;
+}
+
+template <size_t... I> static constexpr std::array<CPU::Handler, sizeof...(I)> makeMoves(std::index_sequence<I...>){
+	return {{&CPU::move<I / 8, I % 8>...}};
+}
+
+/**
+ * Handlers of 0x40-0x7F, indexed by the low 6 bits of the opcode (destination in y, source in z).
+ */
+const std::array<CPU::Handler, 64> CPU::moves = makeMoves(std::make_index_sequence<64>());
+
+/**
+ * Pushes `value` on the stack, high byte first.
+ */
+void CPU::push(unsigned short value){
+	SP -= 2;
+	storeReg(value >> 8, SP + 1);
+	storeReg(value & 0xFF, SP);
+}
+
+unsigned short CPU::pop(){
+	unsigned short value = memory[SP] | memory[(unsigned short)(SP + 1)] << 8;
+	SP += 2;
+	return value;
+}
+
+/**
+ * \param cc Condition as encoded in opcodes: NZ, Z, NC, C.
+ */
+bool CPU::condition(unsigned char cc){
+	unsigned short flag = (cc & 0b10)? cFlag:zFlag;
+	return ((AF & flag) != 0) == (cc & 0b01);
+}
+
+/**
+ * Enters the handler of the highest priority interrupt in `pending` (20 cycles).
+ */
+void CPU::dispatch(unsigned char pending){
+	int bit = __builtin_ctz(pending);
+	memory.write(IF, memory[IF] & ~(1 << bit));
+	ime = false;
+	push(PC);
+	PC = 0x40 + bit * 8;
+	opcode = INTERRUPT_ENTRY | PC;
+	cycles += 20;
 }
 
 /**
@@ -0,0 +1,169 @@
+#ifndef CODEMAP_HPP
+#define CODEMAP_HPP
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include "BlockCache.hpp"
+
+/**
+ * Static map of a cartridge's code, found by recursive descent from the entry point (0x100), the
+ * interrupt vectors and the RST targets: every jump, call and RST target is followed, and so is
+ * the code after conditional branches, calls and RSTs (assumed to return). Descent stops at
+ * undefined opcodes and at jumps it can't resolve (JP HL, RET). Whatever it never reaches counts
+ * as data.
+ *
+ * Blocks end where BlockCache blocks do (endsBlock()), so each one found is an address the cache
+ * will look up, and prewarm() can decode them all before the game runs. The switchable bank is
+ * taken to be bank 1, as mapped on load: code in other banks is only reached by running it.
+ *
+ * Written next to the ROM as an index of "bank:address length" lines, one per block.
+ */
+class CodeMap {
+public:
+	std::map<unsigned, unsigned> blocks; // codeKey() of every block found -> its length in bytes
+
+	void analyze(const unsigned char *rom, unsigned long size);
+	bool load(const char *path);
+	bool write(const char *path) const;
+	unsigned long codeBytes() const;
+	size_t prewarm(BlockCache &cache, Memory &memory) const;
+};
+
+/**
+ * \return the ROM offset of code key `key`.
+ */
+inline unsigned long romOffset(unsigned key){
+	return (key < 0x10000)? key:key - 0x10000;
+}
+
+/**
+ * Maps the code of `rom`, replacing what was there.
+ */
+void CodeMap::analyze(const unsigned char *rom, unsigned long size){
+	blocks.clear();
+	std::vector<unsigned> work = {0x0100, 0x40, 0x48, 0x50, 0x58, 0x60};
+	for (unsigned rst = 0x00; rst <= 0x38; rst += 8){
+		work.push_back(rst);
+	}
+	while (!work.empty()){
+		unsigned key = work.back();
+		work.pop_back();
+		if (blocks.count(key)){
+			continue;
+		}
+		unsigned short bank = (key >= 0x10000)? (key - 0x10000) / 0x4000:1;
+		unsigned short pc = (key >= 0x10000)? 0x4000 + (key - 0x10000) % 0x4000:key;
+		unsigned short start = pc;
+		unsigned short limit = (pc < 0x4000)? 0x4000:0x8000;
+		auto follow = [&](unsigned short target){
+			if (target < 0x8000){
+				work.push_back(codeKey(target, bank));
+			}
+		};
+		bool falls = true;
+		for (size_t ops = 0; ops < BlockCache::maxOps && falls; ops++){ // As BlockCache::decode()
+			unsigned long offset = romOffset(codeKey(pc, bank));
+			if (offset >= size || undefinedOpcode(rom[offset]) || pc + opcodeLengths[rom[offset]] > limit){
+				falls = false; // Data, or off the end of the ROM or bank
+				break;
+			}
+			unsigned char opcode = rom[offset];
+			pc += opcodeLengths[opcode];
+			switch (opcode){
+				case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+					follow(pc + (signed char)rom[offset + 1]);
+					break;
+				case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: // JP
+				case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+					follow(rom[offset + 1] | rom[offset + 2] << 8);
+					break;
+				default:
+					if (callKinds[opcode] == RST){
+						follow(opcode & 0x38);
+					}
+			}
+			if (endsBlock(opcode)){
+				falls = opcode != 0x18 && opcode != 0xC3 && opcode != 0xE9 && opcode != 0xD9 && callKinds[opcode] != RET;
+				break;
+			}
+		}
+		if (falls && pc < 0x8000){
+			follow(pc); // Also where a bank 0 block running into 0x4000 or one cut at maxOps continues
+		}
+		if (pc != start){
+			blocks[key] = (unsigned short)(pc - start);
+		}
+	}
+}
+
+/**
+ * Loads a map written by write().
+ * \return false if the file can't be read.
+ */
+bool CodeMap::load(const char *path){
+	std::ifstream file(path);
+	if (!file){
+		return false;
+	}
+	blocks.clear();
+	std::string line;
+	while (std::getline(file, line)){
+		line = line.substr(0, line.find(';'));
+		unsigned bank, addr, length;
+		if (sscanf(line.c_str(), "%x:%x %u", &bank, &addr, &length) == 3 && addr < 0x8000){
+			blocks[codeKey(addr, bank)] = length;
+		}
+	}
+	return true;
+}
+
+bool CodeMap::write(const char *path) const{
+	FILE *out = fopen(path, "w");
+	if (!out){
+		return false;
+	}
+	fprintf(out, "; bank:address length, one line per block of code\n");
+	for (const auto &block : blocks){
+		char key[16];
+		formatKey(key, sizeof(key), block.first);
+		fprintf(out, "%s %u\n", key, block.second);
+	}
+	fclose(out);
+	return true;
+}
+
+/**
+ * \return the number of ROM bytes found to be code, the rest is data or unreachable.
+ */
+unsigned long CodeMap::codeBytes() const{
+	unsigned long bytes = 0;
+	unsigned long covered = 0; // ROM offset up to which bytes were counted
+	for (const auto &block : blocks){ // In ROM order: bank 0 keys are offsets, banked ones offsets + 0x10000
+		unsigned long first = std::max(romOffset(block.first), covered);
+		unsigned long last = romOffset(block.first) + block.second;
+		if (last > first){
+			bytes += last - first;
+			covered = last;
+		}
+	}
+	return bytes;
+}
+
+/**
+ * Decodes every block of the map into `cache`, from the ROM `memory` maps.
+ * \return the number of blocks decoded.
+ */
+size_t CodeMap::prewarm(BlockCache &cache, Memory &memory) const{
+	unsigned long long lookups = cache.lookups;
+	size_t decoded = 0;
+	for (const auto &block : blocks){
+		decoded += cache.lookupKey(memory, block.first) != nullptr;
+	}
+	cache.lookups = lookups; // Count only lookups made running
+	return decoded;
+}
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef EMULATOR_HPP
+#define EMULATOR_HPP
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include "BlockCache.hpp"
+#include "CPU.hpp"
+#include "PPU.hpp"
+#include "Profiler.hpp"
+#include "Sampler.hpp"
+#include "Trace.hpp"
+
+/**
+ * A CPU and PPU sharing one address space, started in the state the DMG boot ROM leaves behind.
+ */
+class Emulator {
+public:
+	CPU cpu;
+	PPU ppu;
+
+	unsigned long long instructions; // Instructions executed since initialize()
+	Sampler *sampler; // Call stack sampler, nullptr unless sampling
+	Trace *trace; // Execution trace, nullptr unless tracing
+	BlockCache *blocks; // Decoded ROM blocks to run from, nullptr to interpret one instruction at a time
+#ifdef GB_PROFILE
+	CallStack routines;
+#endif
+
+	Emulator() = default;
+	explicit Emulator(PagePool *pool);
+	void initialize();
+	bool loadROM(const unsigned char *data, size_t size);
+	void setButtons(unsigned char buttons);
+	void restore(const Emulator &snapshot);
+	void fork(Emulator &child);
+
+	void step();
+	void runCycles(unsigned long long amount);
+	void runFrames(unsigned long long amount);
+
+	unsigned long long stateHash();
+
+private:
+	void execute();
+	void observedStep();
+	template<class Running, class Budget> void runBlocks(Running running, Budget budget);
+};
+
+/**
+ * An emulator whose memory takes its pages from `pool` (see Memory::pool).
+ */
+Emulator::Emulator(PagePool *pool) : cpu(pool){}
+
+void Emulator::initialize(){
+	cpu.initialize();
+	cpu.memory.clear();
+	// Registers after the boot ROM hands over to the cartridge
+	cpu.AF = 0x01B0;
+	cpu.BC = 0x0013;
+	cpu.DE = 0x00D8;
+	cpu.HL = 0x014D;
+	cpu.SP = 0xFFFE;
+	cpu.PC = 0x0100;
+	cpu.memory[P1] = 0xCF;
+	cpu.memory[IF] = 0xE1;
+	cpu.memory[LCDC] = 0x91;
+	cpu.memory[BGP] = 0xFC;
+	ppu.initialize(&cpu.memory);
+	instructions = 0;
+	sampler = nullptr;
+	trace = nullptr;
+	blocks = nullptr;
+#ifdef GB_PROFILE
+	routines.reset();
+#endif
+}
+
+/**
+ * Maps `data` as the cartridge. The ROM is shared, not copied, so it must outlive the emulator
+ * (and every snapshot of it).
+ * \return false if the ROM is smaller than 32KB.
+ */
+bool Emulator::loadROM(const unsigned char *data, size_t size){
+	return cpu.memory.mapROM(data, size);
+}
+
+/**
+ * Sets the pressed buttons (see CPU::buttons), requesting the joypad interrupt on a new press.
+ */
+void Emulator::setButtons(unsigned char buttons){
+	if (buttons & ~cpu.buttons){
+		cpu.memory.write(IF, cpu.memory[IF] | joypadInterrupt);
+	}
+	cpu.buttons = buttons;
+	cpu.updateJoypad();
+}
+
+/**
+ * Replaces the whole state with `snapshot`, a copy of an emulator taken earlier. What is attached to
+ * this emulator (sampler, trace and block cache) stays attached to it. The profiled call stack is
+ * part of the state and comes from the snapshot.
+ * RAM is shared copy-on-write with the snapshot (see Memory::operator=), so this costs O(pages)
+ * pointer updates plus a page copy for every page written afterwards.
+ */
+void Emulator::restore(const Emulator &snapshot){
+	Sampler *sampler = this->sampler;
+	Trace *trace = this->trace;
+	BlockCache *blocks = this->blocks;
+	*this = snapshot;
+	ppu.memory = &cpu.memory; // The copied PPU still points at the snapshot's memory
+	this->sampler = sampler;
+	this->trace = trace;
+	this->blocks = blocks;
+}
+
+/**
+ * Turns `child` into a copy-on-write copy of this emulator, to branch off into a different future.
+ * Observers attached to this emulator aren't handed to the child (see restore()).
+ */
+void Emulator::fork(Emulator &child){
+	child.restore(*this);
+}
+
+/**
+ * Executes one instruction and lets the PPU catch up on the cycles it took.
+ */
+void Emulator::step(){
+	if (sampler || trace){
+		observedStep();
+	} else {
+		execute();
+	}
+}
+
+inline void Emulator::execute(){
+#ifdef GB_PROFILE
+	unsigned short pc = cpu.PC;
+	unsigned short bank = cpu.memory.bank;
+#endif
+	unsigned long long start = cpu.cycles;
+	cpu.step();
+	ppu.tick(cpu.cycles - start);
+	if (cpu.cycles >= cpu.dmaEnd){ // OAM DMA gives the bus back
+		cpu.memory.endDMA();
+		cpu.dmaEnd = ~0ULL;
+	}
+	instructions++;
+#ifdef GB_PROFILE
+	Profiler::record(routines, cpu, pc, bank, cpu.cycles - start);
+#endif
+}
+
+/**
+ * step() with a sampler or trace attached, kept apart so the common path stays lean.
+ */
+inline void Emulator::observedStep(){
+	unsigned short pc = cpu.PC;
+	unsigned short bank = cpu.memory.bank;
+	if (trace){
+		trace->record(cpu);
+	}
+	execute();
+	if (sampler){
+		sampler->step(cpu, pc, bank);
+	}
+	if (trace){
+		if (cpu.opcode >= INTERRUPT_ENTRY || (cpu.halted && cpu.PC == pc)){ // Not an instruction
+			trace->retract();
+		}
+		if (cpu.fault){
+			trace->faulted();
+		}
+	}
+}
+
+/**
+ * Runs from the block cache while `running()`, stopping exactly where stepping would.
+ * Instructions run one by one through execute() whenever a block can't be used: EI's delay, HALT,
+ * interrupt entry, OAM DMA holding the bus and code in the IO registers. Blocks in RAM are checked to still match memory
+ * on entry and wherever they may stop.
+ *
+ * A block that ends before the PPU's next mode change and within `budget()` cycles (before which
+ * running() can't turn false by time alone) takes the fast path: nothing can interrupt it but its
+ * own memory writes and faults, so only those get checked, the PPU catches up once at the end and
+ * flags-dead handler variants and superinstructions are safe. Otherwise every instruction is checked and ticked.
+ * Copy and fill loops run in bulk through runLoop() for as long as the same holds. Blocks of a
+ * recompiled ROM (BlockCache::attach()) run their compiled code as the fast path.
+ */
+template<class Running, class Budget>
+void Emulator::runBlocks(Running running, Budget budget){
+	Block *block = nullptr;
+	while (running()){
+		if (cpu.eiDelay || cpu.halted || cpu.memory.dma || (cpu.ime && cpu.pendingInterrupts())){
+			execute();
+			block = nullptr;
+			continue;
+		}
+		if (!block && !(block = blocks->lookup(cpu.memory, cpu.PC))){
+			execute();
+			continue;
+		}
+		if (block->ram && !(block = blocks->refresh(*block, cpu.memory))){
+			execute();
+			continue;
+		}
+		unsigned short bank = cpu.memory.bank;
+		auto stops = [&]{
+			return !running() || (block->banked && cpu.memory.bank != bank) || (cpu.ime && cpu.pendingInterrupts()) || cpu.memory.dma ||
+				(block->ram && blocks->stale(*block, cpu.memory)); // Code that rewrote itself
+		};
+#ifdef GB_PROFILE
+		bool fast = false; // Profiles count every instruction as it runs
+		(void)budget;
+#else
+		if (block->loop != NO_LOOP){
+			unsigned long long horizon = budget();
+			if (ppu.framebuffer || (cpu.ime && (cpu.memory[IE] & 0x1F))){
+				horizon = std::min<unsigned long long>(horizon, ppu.dots); // Rendering and interrupts happen on mode changes
+			}
+			unsigned long long start = cpu.cycles;
+			unsigned iterations = runLoop(*block, cpu, horizon);
+			if (iterations){
+				ppu.tick(cpu.cycles - start);
+				instructions += (unsigned long long)iterations * block->ops.size();
+				blocks->loopIterations += iterations;
+				if (cpu.PC == block->end){
+					block = cpu.memory.dma? nullptr:blocks->next(*block, cpu);
+				}
+				continue;
+			}
+		}
+		bool fast = (int)block->maxCycles < ppu.dots && block->maxCycles < budget();
+#endif
+		bool finished;
+		if (fast && block->compiled){
+			unsigned long long start = cpu.cycles;
+			unsigned char done = block->compiled(cpu);
+			ppu.tick(cpu.cycles - start);
+			finished = done == block->ops.size();
+			instructions += done;
+		} else if (fast){
+			const FastOp *op = block->fastOps.data();
+			const FastOp *end = op + block->fastOps.size();
+			unsigned long long start = cpu.cycles;
+			do {
+				op->handler(cpu, op->opcode);
+			} while (++op != end && !(op[-1].check && stops()));
+			ppu.tick(cpu.cycles - start);
+			finished = op == end;
+			instructions += finished? block->ops.size():op->index;
+		} else {
+			const BlockOp *op = block->ops.data();
+			const BlockOp *end = op + block->ops.size();
+			while (true){
+#ifdef GB_PROFILE
+				unsigned short pc = cpu.PC;
+#endif
+				unsigned long long start = cpu.cycles;
+				op->handler(cpu, op->opcode);
+				ppu.tick(cpu.cycles - start);
+				instructions++;
+#ifdef GB_PROFILE
+				Profiler::record(routines, cpu, pc, bank, cpu.cycles - start);
+#endif
+				if (++op == end || stops()){
+					break;
+				}
+			}
+			finished = op == end;
+		}
+		block = finished && !cpu.memory.dma? blocks->next(*block, cpu):nullptr; // The next block may be behind the bus OAM DMA holds
+	}
+}
+
+/**
+ * Runs for at least `amount` T-cycles, or until the CPU faults.
+ */
+void Emulator::runCycles(unsigned long long amount){
+	unsigned long long target = cpu.cycles + amount;
+	if (sampler || trace){
+		while (cpu.cycles < target && !cpu.fault){
+			observedStep();
+		}
+	} else if (blocks){
+		runBlocks([&]{ return cpu.cycles < target && !cpu.fault; }, [&]{ return target - cpu.cycles; });
+	} else {
+		while (cpu.cycles < target && !cpu.fault){
+			execute();
+		}
+	}
+}
+
+/**
+ * Runs until `amount` more frames have reached VBlank, or until the CPU faults.
+ */
+void Emulator::runFrames(unsigned long long amount){
+	unsigned long long target = ppu.frames + amount;
+	if (sampler || trace){
+		while (ppu.frames < target && !cpu.fault){
+			observedStep();
+		}
+	} else if (blocks){
+		runBlocks([&]{ return ppu.frames < target && !cpu.fault; }, [&]{ return ppu.cyclesToVBlank(); });
+	} else {
+		while (ppu.frames < target && !cpu.fault){
+			execute();
+		}
+	}
+}
+
+/**
+ * FNV-1a hash of the registers, cycle count and the whole address space.
+ */
+unsigned long long Emulator::stateHash(){
+	unsigned long long hash = 0xCBF29CE484222325;
+	auto mix = [&hash](unsigned char byte){
+		hash ^= byte;
+		hash *= 0x100000001B3;
+	};
+	unsigned short regs[] = {cpu.AF, cpu.BC, cpu.DE, cpu.HL, cpu.SP, cpu.PC};
+	for (unsigned short reg : regs){
+		mix(reg & 0xFF);
+		mix(reg >> 8);
+	}
+	for (int i = 0; i < 8; i++){
+		mix((cpu.cycles >> (i * 8)) & 0xFF);
+	}
+	for (int addr = 0; addr <= 0xFFFF; addr++){
+		mix(cpu.memory[addr]);
+	}
+	return hash;
+}
+
+/**
+ * Reads the whole file at `path` into `rom`.
+ * \return false if the file can't be read.
+ */
+bool readROM(const char *path, std::vector<unsigned char> &rom){
+	std::ifstream file(path, std::ios::binary);
+	if (!file){
+		return false;
+	}
+	rom.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+#endif
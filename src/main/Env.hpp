@@ -0,0 +1,98 @@
+#ifndef ENV_HPP
+#define ENV_HPP
+
+#include <vector>
+#include "Emulator.hpp"
+#include "ThreadPool.hpp"
+
+/**
+ * What an agent sees after a step. Both pointers point straight into the Env and stay valid
+ * (with updated contents) until the Env is destroyed.
+ */
+struct Observation {
+	const unsigned char *framebuffer; // 160x144 shades, see PPU::framebuffer
+	const unsigned char *wram; // 0xC000-0xDFFF
+	bool done; // The CPU faulted and the episode can't continue
+};
+
+/**
+ * Reinforcement-learning environment over one emulator.
+ * reset() restores a snapshot rather than re-running the boot sequence, and step() only renders
+ * the last of the frames it skips.
+ */
+class Env {
+public:
+	Emulator emulator;
+	Emulator start; // State reset() goes back to
+	unsigned char screen[144 * 160]; // Framebuffer the last frame of every step is drawn into
+
+	Env(const unsigned char *rom, size_t size);
+
+	Observation reset();
+	Observation step(unsigned char action, int frameskip = 1);
+	void setResetState();
+	Observation observe();
+
+	static void stepMany(const std::vector<Env *> &envs, const std::vector<unsigned char> &actions, int frameskip, ThreadPool &pool);
+};
+
+/**
+ * Boots the ROM and keeps that state as the reset point. The ROM isn't copied and must outlive the Env.
+ */
+Env::Env(const unsigned char *rom, size_t size){
+	memset(screen, 0, sizeof(screen));
+	emulator.initialize();
+	emulator.loadROM(rom, size);
+	setResetState();
+}
+
+/**
+ * Makes the current state the one reset() goes back to (e.g. after skipping a title screen).
+ */
+void Env::setResetState(){
+	start.restore(emulator);
+	emulator.cpu.memory.own(0xC0, 0xDF); // Keep WRAM contiguous for the observation
+}
+
+Observation Env::reset(){
+	emulator.restore(start);
+	emulator.cpu.memory.own(0xC0, 0xDF); // Keep WRAM contiguous for the observation
+	return observe();
+}
+
+/**
+ * Holds `action` (pressed buttons, see CPU::buttons) for `frameskip` frames.
+ */
+Observation Env::step(unsigned char action, int frameskip){
+	emulator.setButtons(action);
+	if (frameskip > 1){
+		emulator.ppu.framebuffer = nullptr;
+		emulator.runFrames(frameskip - 1);
+	}
+	emulator.ppu.framebuffer = screen;
+	emulator.runFrames(1);
+	return observe();
+}
+
+Observation Env::observe(){
+	return {screen, &emulator.cpu.memory.ram[0xC000 - 0x8000], emulator.cpu.fault};
+}
+
+/**
+ * Steps `envs[i]` with `actions[i]` on `pool`, returning once every env has stepped.
+ * Envs are handed out in small slices so idle workers can steal the rest.
+ */
+void Env::stepMany(const std::vector<Env *> &envs, const std::vector<unsigned char> &actions, int frameskip, ThreadPool &pool){
+	size_t slice = std::max((size_t)1, envs.size() / (pool.size() * 4));
+	for (size_t first = 0; first < envs.size(); first += slice){
+		size_t last = std::min(envs.size(), first + slice);
+		pool.submit([&envs, &actions, frameskip, first, last]{
+			for (size_t i = first; i < last; i++){
+				envs[i]->step(actions[i], frameskip);
+			}
+		});
+	}
+	pool.wait();
+}
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef LOCKSTEP_HPP
+#define LOCKSTEP_HPP
+
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "Emulator.hpp"
+
+/**
+ * Experimental engine that steps many emulators running the same ROM in lockstep.
+ *
+ * The registers of every lane are kept as structure-of-arrays. Each step, lanes that share a PC
+ * execute that opcode together: with AVX2, 16 lanes per vector under a lane mask. Opcodes without
+ * a vector kernel, lanes that diverged and lanes that must do something else than run the opcode
+ * at PC (see scalarOnly()) go through the scalar CPU of their lane.
+ * Lanes must be created from the same ROM (only opcodes fetched outside bank 0, from the
+ * switchable bank or RAM, are compared per lane).
+ */
+class Lockstep {
+public:
+	std::vector<Emulator *> lanes;
+	std::vector<unsigned short> AF, BC, DE, HL, SP, PC; // One entry per lane, padded to a multiple of 16
+
+	unsigned long long vectorSteps; // Lane instructions executed by vector kernels
+	unsigned long long scalarSteps; // Lane instructions executed by the scalar CPU
+
+	void attach(const std::vector<Emulator *> &emulators);
+	void step();
+	void store();
+
+private:
+	std::vector<unsigned short> mask; // 0xFFFF for lanes in the group being executed
+	std::vector<unsigned short> pending; // 0xFFFF for lanes that haven't executed this step
+
+	bool scalarOnly(size_t lane) const;
+	void runScalar(size_t lane);
+	bool runVector(unsigned char opcode);
+	void finishVector(unsigned char opcode);
+
+#ifdef __AVX2__
+	void incKernel(std::vector<unsigned short> &reg, int amount, MODE mode);
+	void incPairKernel(std::vector<unsigned short> &reg, int amount);
+	void addPairsKernel(std::vector<unsigned short> &reg);
+	void rotateKernel(bool useCarry, DIRECTION d);
+	void aluKernel(unsigned char op, std::vector<unsigned short> &reg, MODE mode);
+	void moveKernel(std::vector<unsigned short> &dst, MODE dstMode, std::vector<unsigned short> &src, MODE srcMode);
+#endif
+};
+
+/**
+ * Takes over the registers of `emulators`. They must not be stepped directly until store() is called.
+ */
+void Lockstep::attach(const std::vector<Emulator *> &emulators){
+	lanes = emulators;
+	size_t padded = (lanes.size() + 15) / 16 * 16;
+	for (std::vector<unsigned short> *reg : {&AF, &BC, &DE, &HL, &SP, &PC, &mask, &pending}){
+		reg->assign(padded, 0);
+	}
+	for (size_t i = 0; i < lanes.size(); i++){
+		const CPU &cpu = lanes[i]->cpu;
+		AF[i] = cpu.AF; BC[i] = cpu.BC; DE[i] = cpu.DE; HL[i] = cpu.HL; SP[i] = cpu.SP; PC[i] = cpu.PC;
+	}
+	vectorSteps = 0;
+	scalarSteps = 0;
+}
+
+/**
+ * Copies the registers back into the lanes' CPUs.
+ */
+void Lockstep::store(){
+	for (size_t i = 0; i < lanes.size(); i++){
+		CPU &cpu = lanes[i]->cpu;
+		cpu.AF = AF[i]; cpu.BC = BC[i]; cpu.DE = DE[i]; cpu.HL = HL[i]; cpu.SP = SP[i]; cpu.PC = PC[i];
+	}
+}
+
+/**
+ * Executes one instruction on every lane.
+ */
+void Lockstep::step(){
+	size_t count = lanes.size();
+	for (size_t i = 0; i < count; i++){
+		pending[i] = 0xFFFF;
+	}
+	size_t leader = 0;
+	while (true){
+		while (leader < count && !pending[leader]){
+			leader++;
+		}
+		if (leader == count){
+			break;
+		}
+		// Group every pending lane that shares the leader's PC
+		unsigned short pc = PC[leader];
+		unsigned char opcode = lanes[leader]->cpu.memory[pc];
+		for (size_t i = 0; i < mask.size(); i++){
+			mask[i] = (PC[i] == pc)? pending[i]:0;
+		}
+		if (pc >= 0x4000){ // Lanes can have other banks mapped, or other code in RAM
+			for (size_t i = leader; i < count; i++){
+				if (mask[i] && lanes[i]->cpu.memory[pc] != opcode) mask[i] = 0;
+			}
+		}
+		for (size_t i = leader; i < count; i++){
+			if (mask[i] && scalarOnly(i)){
+				runScalar(i);
+				pending[i] = 0;
+				mask[i] = 0;
+			}
+		}
+
+		if (runVector(opcode)){
+			finishVector(opcode);
+		} else {
+			for (size_t i = leader; i < count; i++){
+				if (mask[i]) runScalar(i);
+			}
+		}
+		for (size_t i = 0; i < mask.size(); i++){
+			pending[i] &= ~mask[i];
+		}
+	}
+}
+
+/**
+ * \return true if `lane` must step through its own CPU whatever its opcode, as CPU::step() does
+ * something else than run it or keeps state the kernels don't: HALT, EI's delay, an interrupt to
+ * enter, or OAM DMA holding the bus (only Emulator::step() gives it back).
+ */
+bool Lockstep::scalarOnly(size_t lane) const{
+	const CPU &cpu = lanes[lane]->cpu;
+	return cpu.halted || cpu.eiDelay || (cpu.ime && cpu.pendingInterrupts()) || cpu.memory.dma;
+}
+
+/**
+ * Runs one instruction of `lane` through its own CPU.
+ */
+void Lockstep::runScalar(size_t lane){
+	Emulator &emulator = *lanes[lane];
+	CPU &cpu = emulator.cpu;
+	cpu.AF = AF[lane]; cpu.BC = BC[lane]; cpu.DE = DE[lane]; cpu.HL = HL[lane]; cpu.SP = SP[lane]; cpu.PC = PC[lane];
+	emulator.step();
+	AF[lane] = cpu.AF; BC[lane] = cpu.BC; DE[lane] = cpu.DE; HL[lane] = cpu.HL; SP[lane] = cpu.SP; PC[lane] = cpu.PC;
+	scalarSteps++;
+}
+
+/**
+ * Advances PC and the per-lane clocks of the masked lanes after a vector kernel.
+ */
+void Lockstep::finishVector(unsigned char opcode){
+	unsigned char cost = opcodeCycles[opcode];
+	for (size_t i = 0; i < lanes.size(); i++){
+		if (mask[i]){
+			Emulator &emulator = *lanes[i];
+			PC[i]++; // Every vectorized opcode is 1 byte long
+			emulator.cpu.cycles += cost;
+			emulator.ppu.tick(cost);
+			emulator.instructions++;
+			vectorSteps++;
+		}
+	}
+}
+
+#ifndef __AVX2__
+
+/**
+ * No vector kernels without AVX2: every group goes through the scalar CPU.
+ */
+bool Lockstep::runVector(unsigned char){
+	return false;
+}
+
+#else
+
+/**
+ * Runs `opcode` on the masked lanes with a vector kernel.
+ * \return false if the opcode has no kernel.
+ */
+bool Lockstep::runVector(unsigned char opcode){
+	switch (opcode){
+		case 0x00: break;
+		case 0x03: incPairKernel(BC, 1); break;
+		case 0x13: incPairKernel(DE, 1); break;
+		case 0x23: incPairKernel(HL, 1); break;
+		case 0x33: incPairKernel(SP, 1); break;
+		case 0x0B: incPairKernel(BC, -1); break;
+		case 0x1B: incPairKernel(DE, -1); break;
+		case 0x2B: incPairKernel(HL, -1); break;
+		case 0x3B: incPairKernel(SP, -1); break;
+		case 0x04: incKernel(BC, 1, HIGH); break;
+		case 0x14: incKernel(DE, 1, HIGH); break;
+		case 0x24: incKernel(HL, 1, HIGH); break;
+		case 0x05: incKernel(BC, -1, HIGH); break;
+		case 0x15: incKernel(DE, -1, HIGH); break;
+		case 0x25: incKernel(HL, -1, HIGH); break;
+		case 0x0C: incKernel(BC, 1, LOW); break;
+		case 0x1C: incKernel(DE, 1, LOW); break;
+		case 0x2C: incKernel(HL, 1, LOW); break;
+		case 0x0D: incKernel(BC, -1, LOW); break;
+		case 0x1D: incKernel(DE, -1, LOW); break;
+		case 0x2D: incKernel(HL, -1, LOW); break;
+		case 0x07: rotateKernel(false, LEFT); break;
+		case 0x17: rotateKernel(true, LEFT); break;
+		case 0x0F: rotateKernel(true, RIGHT); break;
+		case 0x09: addPairsKernel(BC); break;
+		case 0x19: addPairsKernel(DE); break;
+		case 0x29: addPairsKernel(HL); break;
+		case 0x39: addPairsKernel(SP); break;
+		default: {
+			// 8-bit register operands as encoded in opcodes; (HL) has no kernel
+			std::vector<unsigned short> *regs[8] = {&BC, &BC, &DE, &DE, &HL, &HL, nullptr, &AF};
+			const MODE modes[8] = {HIGH, LOW, HIGH, LOW, HIGH, LOW, PAIR, HIGH};
+			unsigned char y = (opcode >> 3) & 0x07;
+			unsigned char z = opcode & 0x07;
+			if ((opcode & 0xC0) == 0x40 && y != 6 && z != 6){ // LD r, r'
+				moveKernel(*regs[y], modes[y], *regs[z], modes[z]);
+			} else if ((opcode & 0xC0) == 0x80 && z != 6){ // ALU A, r
+				aluKernel(y, *regs[z], modes[z]);
+			} else {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static inline __m256i load16(const unsigned short *lanes){
+	return _mm256_loadu_si256((const __m256i *)lanes);
+}
+
+/**
+ * Stores `value` into the lanes selected by `mask`, leaving the others unchanged.
+ */
+static inline void maskedStore16(unsigned short *lanes, __m256i value, __m256i mask){
+	__m256i old = load16(lanes);
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_or_si256(_mm256_and_si256(mask, value), _mm256_andnot_si256(mask, old)));
+}
+
+/**
+ * Vector CPU::incReg for the 8-bit registers.
+ */
+void Lockstep::incKernel(std::vector<unsigned short> &reg, int amount, MODE mode){
+	const __m256i byte = _mm256_set1_epi16(0x00FF);
+	for (size_t i = 0; i < mask.size(); i += 16){
+		__m256i m = load16(&mask[i]);
+		__m256i r = load16(&reg[i]);
+		__m256i af = load16(&AF[i]);
+		__m256i half = (mode == HIGH)? _mm256_srli_epi16(r, 8):_mm256_and_si256(r, byte);
+		half = _mm256_and_si256(_mm256_add_epi16(half, _mm256_set1_epi16(amount)), byte);
+		// Same as the flag tables: Z on 0, H when the low nibble wrapped (to 0x0 up, 0xF down)
+		__m256i nibble = _mm256_and_si256(half, _mm256_set1_epi16(0x0F));
+		__m256i z = _mm256_and_si256(_mm256_cmpeq_epi16(half, _mm256_setzero_si256()), _mm256_set1_epi16(zFlag));
+		__m256i h = _mm256_and_si256(_mm256_cmpeq_epi16(nibble, _mm256_set1_epi16((amount > 0)? 0x00:0x0F)), _mm256_set1_epi16(hFlag));
+		__m256i flags = _mm256_or_si256(_mm256_or_si256(z, h), _mm256_set1_epi16((amount > 0)? 0:nFlag));
+		r = (mode == HIGH)? _mm256_or_si256(_mm256_slli_epi16(half, 8), _mm256_and_si256(r, byte)):
+			_mm256_or_si256(_mm256_andnot_si256(byte, r), half);
+		af = _mm256_or_si256(_mm256_andnot_si256(_mm256_set1_epi16(zFlag | nFlag | hFlag), af), flags);
+		maskedStore16(&reg[i], r, m);
+		maskedStore16(&AF[i], af, m);
+	}
+}
+
+/**
+ * Vector CPU::incReg for register pairs (no flags).
+ */
+void Lockstep::incPairKernel(std::vector<unsigned short> &reg, int amount){
+	const __m256i step = _mm256_set1_epi16(amount);
+	for (size_t i = 0; i < mask.size(); i += 16){
+		maskedStore16(&reg[i], _mm256_add_epi16(load16(&reg[i]), step), load16(&mask[i]));
+	}
+}
+
+/**
+ * Vector CPU::addPairs with HL as the destination.
+ */
+void Lockstep::addPairsKernel(std::vector<unsigned short> &reg){
+	const __m256i low12 = _mm256_set1_epi16(0x0FFF);
+	const __m256i one = _mm256_set1_epi16(1);
+	for (size_t i = 0; i < mask.size(); i += 16){
+		__m256i m = load16(&mask[i]);
+		__m256i hl = load16(&HL[i]);
+		__m256i r = load16(&reg[i]);
+		__m256i af = load16(&AF[i]);
+		__m256i sum = _mm256_add_epi16(hl, r);
+		__m256i half = _mm256_and_si256(_mm256_srli_epi16(_mm256_add_epi16(_mm256_and_si256(hl, low12), _mm256_and_si256(r, low12)), 12), one);
+		__m256i carry = _mm256_srli_epi16(_mm256_or_si256(_mm256_and_si256(hl, r), _mm256_andnot_si256(sum, _mm256_or_si256(hl, r))), 15); // Carry out of bit 15
+		af = _mm256_andnot_si256(_mm256_set1_epi16(nFlag | hFlag | cFlag), af);
+		af = _mm256_or_si256(af, _mm256_or_si256(_mm256_slli_epi16(half, 5), _mm256_slli_epi16(carry, 4)));
+		maskedStore16(&AF[i], af, m);
+		maskedStore16(&HL[i], sum, m);
+	}
+}
+
+/**
+ * Vector CPU::rotate of register A.
+ */
+void Lockstep::rotateKernel(bool useCarry, DIRECTION d){
+	const __m256i byte = _mm256_set1_epi16(0x00FF);
+	const __m256i one = _mm256_set1_epi16(1);
+	for (size_t i = 0; i < mask.size(); i += 16){
+		__m256i m = load16(&mask[i]);
+		__m256i af = load16(&AF[i]);
+		__m256i a = _mm256_srli_epi16(af, 8);
+		__m256i out, in;
+		if (d == LEFT){
+			out = _mm256_srli_epi16(a, 7);
+			in = useCarry? _mm256_and_si256(_mm256_srli_epi16(af, 4), one):out;
+			a = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(a, 1), in), byte);
+		} else {
+			out = _mm256_and_si256(a, one);
+			a = _mm256_or_si256(_mm256_srli_epi16(a, 1), _mm256_slli_epi16(out, 7));
+		}
+		af = _mm256_and_si256(af, _mm256_set1_epi16(0x00FF & ~(zFlag | nFlag | hFlag | cFlag)));
+		af = _mm256_or_si256(af, _mm256_or_si256(_mm256_slli_epi16(a, 8), _mm256_slli_epi16(out, 4)));
+		maskedStore16(&AF[i], af, m);
+	}
+}
+
+/**
+ * Vector CPU::move between 8-bit registers.
+ */
+void Lockstep::moveKernel(std::vector<unsigned short> &dst, MODE dstMode, std::vector<unsigned short> &src, MODE srcMode){
+	const __m256i byte = _mm256_set1_epi16(0x00FF);
+	for (size_t i = 0; i < mask.size(); i += 16){
+		__m256i s = load16(&src[i]);
+		__m256i value = (srcMode == HIGH)? _mm256_srli_epi16(s, 8):_mm256_and_si256(s, byte);
+		__m256i d = load16(&dst[i]); // After the source, which may be the same pair
+		d = (dstMode == HIGH)? _mm256_or_si256(_mm256_slli_epi16(value, 8), _mm256_and_si256(d, byte)):
+			_mm256_or_si256(_mm256_andnot_si256(byte, d), value);
+		maskedStore16(&dst[i], d, load16(&mask[i]));
+	}
+}
+
+/**
+ * Vector alu() with an 8-bit register as the operand.
+ */
+void Lockstep::aluKernel(unsigned char op, std::vector<unsigned short> &reg, MODE mode){
+	const __m256i byte = _mm256_set1_epi16(0x00FF);
+	const __m256i zero = _mm256_setzero_si256();
+	for (size_t i = 0; i < mask.size(); i += 16){
+		__m256i m = load16(&mask[i]);
+		__m256i af = load16(&AF[i]);
+		__m256i r = load16(&reg[i]);
+		__m256i a = _mm256_srli_epi16(af, 8);
+		__m256i b = (mode == HIGH)? _mm256_srli_epi16(r, 8):_mm256_and_si256(r, byte);
+		__m256i carry = (op == ADC || op == SBC)? _mm256_and_si256(_mm256_srli_epi16(af, 4), _mm256_set1_epi16(1)):zero;
+		__m256i result, flags;
+		if (op <= SBC || op == CP){
+			// 16-bit lanes hold the 9-bit result, bit 8 being the carry (borrow) as in the flag tables
+			result = (op <= ADC)? _mm256_add_epi16(_mm256_add_epi16(a, b), carry):
+				_mm256_and_si256(_mm256_sub_epi16(_mm256_sub_epi16(a, b), carry), _mm256_set1_epi16(0x01FF));
+			__m256i c = _mm256_slli_epi16(_mm256_srli_epi16(result, 8), 4);
+			__m256i h = _mm256_slli_epi16(_mm256_and_si256(_mm256_xor_si256(_mm256_xor_si256(a, b), result), _mm256_set1_epi16(0x10)), 1);
+			flags = _mm256_or_si256(c, h);
+			if (op >= SUB){
+				flags = _mm256_or_si256(flags, _mm256_set1_epi16(nFlag));
+			}
+		} else {
+			result = (op == AND)? _mm256_and_si256(a, b):(op == XOR)? _mm256_xor_si256(a, b):_mm256_or_si256(a, b);
+			flags = (op == AND)? _mm256_set1_epi16(hFlag):zero;
+		}
+		result = _mm256_and_si256(result, byte);
+		flags = _mm256_or_si256(flags, _mm256_and_si256(_mm256_cmpeq_epi16(result, zero), _mm256_set1_epi16(zFlag)));
+		__m256i newA = (op == CP)? a:result;
+		maskedStore16(&AF[i], _mm256_or_si256(_mm256_slli_epi16(newA, 8), flags), m);
+	}
+}
+
+#endif
+
+#endif
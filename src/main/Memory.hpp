@@ -0,0 +1,456 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+class PagePool;
+
+/**
+ * A page of RAM shared copy-on-write between instances (see Memory::operator=).
+ */
+struct SharedPage {
+	std::atomic<unsigned> refs; // Instances mapping this page
+	PagePool *pool; // Pool the page returns to
+	unsigned char data[256];
+};
+
+/**
+ * Free list of pages, so sharing and unsharing doesn't go through the heap every time. The
+ * process wide `heap` pool grows on the general heap; other pools first carve pages out of
+ * storage they're given (see carve()).
+ */
+class PagePool {
+public:
+	static PagePool heap;
+
+	PagePool();
+	PagePool(const PagePool &) = delete;
+	PagePool &operator=(const PagePool &) = delete;
+
+	void carve(void *storage, size_t count);
+	SharedPage *allocate();
+	static void release(SharedPage *page);
+
+private:
+	std::mutex lock;
+	SharedPage *free; // Released pages, linked through their data
+	SharedPage *storage;
+	size_t count; // Pages in storage
+	size_t used; // Pages of storage handed out at least once
+};
+
+PagePool PagePool::heap;
+
+PagePool::PagePool() : free(nullptr), storage(nullptr), count(0), used(0){}
+
+/**
+ * Hands out the `count` pages `storage` has room for before growing on the heap. It must outlive
+ * every page taken from it.
+ */
+void PagePool::carve(void *storage, size_t count){
+	std::lock_guard<std::mutex> guard(lock);
+	this->storage = (SharedPage *)storage;
+	this->count = count;
+	used = 0;
+}
+
+/**
+ * \return a page holding one reference, from the heap pool once this one's storage is used up.
+ */
+SharedPage *PagePool::allocate(){
+	SharedPage *page = nullptr;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (free){
+			page = free;
+			free = *(SharedPage **)page->data;
+		} else if (used < count){
+			page = new (&storage[used++]) SharedPage();
+			page->pool = this;
+		}
+	}
+	if (!page){
+		if (this != &heap){
+			return heap.allocate();
+		}
+		page = new SharedPage();
+		page->pool = this;
+	}
+	page->refs = 1;
+	return page;
+}
+
+/**
+ * Drops one reference to `page`, recycling it into its pool when it was the last.
+ */
+void PagePool::release(SharedPage *page){
+	if (--page->refs == 0){
+		PagePool *pool = page->pool;
+		std::lock_guard<std::mutex> guard(pool->lock);
+		*(SharedPage **)page->data = pool->free;
+		pool->free = page;
+	}
+}
+
+/**
+ * 16-bit address space made of 256 pages of 256 bytes.
+ *
+ * 0x0000-0x7FFF maps the cartridge ROM, which is shared between instances and never copied
+ * (0x4000-0x7FFF follows the selected bank). Without a cartridge it maps writable pages of the
+ * instance instead, taken from its pool only then so instances running a cartridge stay small.
+ * 0x8000-0xFFFF is the instance's RAM: each page either lives in `ram` or is a SharedPage that
+ * copies of this memory map copy-on-write until one of them writes to it.
+ */
+class Memory {
+public:
+	unsigned char ram[0x8000]; // 0x8000-0xFFFF
+	PagePool *pool; // Where the pages below come from, this memory's own and the ones copies of it share
+	SharedPage *bare[128]; // Private pages mapped at 0x0000-0x7FFF while no cartridge is, nullptr otherwise
+	mutable SharedPage *shared[128]; // Shared page mapped at 0x8000 + i * 256, nullptr if it lives in `ram`
+	mutable unsigned char *pages[256]; // Host address of every page
+
+	unsigned generations[256]; // Per page, bumped by every write() to it but the IO registers', so code decoded from it can tell it may have changed
+	unsigned long long incarnation; // Unique to these contents: a new one after every assignment and clear()
+	static std::atomic<unsigned long long> incarnations;
+
+	const unsigned char *rom; // Cartridge ROM, nullptr if none is mapped
+	unsigned long romSize;
+	unsigned char mbc; // Cartridge type (header byte 0x147)
+	unsigned short bank; // ROM bank mapped at 0x4000-0x7FFF
+
+	bool dma; // OAM DMA holds the bus, see startDMA()
+	unsigned char dmaSource; // Page OAM DMA copies from
+	unsigned char busy[256]; // Mapped over the pages OAM DMA holds the bus of: reads 0xFF, writes are dropped
+
+	Memory(PagePool *pool = &PagePool::heap);
+	Memory(const Memory &other);
+	Memory &operator=(const Memory &other);
+	~Memory();
+
+	/**
+	 * Raw access to any address. Writes through this skip the MBC, copy-on-write and `generations`, so the
+	 * emulator only writes through write(). While OAM DMA holds the bus, the pages it holds map `busy`:
+	 * nothing may be written through this to them.
+	 */
+	inline unsigned char &operator[](unsigned short addr) { return pages[addr >> 8][addr & 0xFF]; }
+
+	/**
+	 * Writes to RAM, first taking a private copy of the page if it's shared. Writes to the IO registers
+	 * (0xFF00-0xFF7F) leave the generation of their page alone: no code runs from them, and the PPU
+	 * updating LY and STAT every line would otherwise keep code in HRAM being compared.
+	 */
+	inline void write(unsigned short addr, unsigned char value){
+		if (pages[addr >> 8] == busy){
+			return;
+		}
+		if (addr >= 0x8000 && shared[(addr >> 8) - 0x80]){
+			unshare((addr >> 8) - 0x80);
+		}
+		pages[addr >> 8][addr & 0xFF] = value;
+		generations[addr >> 8] += (addr & 0xFF80) != 0xFF00;
+	}
+
+	void clear();
+	bool mapROM(const unsigned char *data, unsigned long size);
+	void writeROM(unsigned short addr, unsigned char value);
+	void mapPages();
+	void own(unsigned char firstPage, unsigned char lastPage);
+	void copy(unsigned short dst, unsigned short src, unsigned length);
+	void fill(unsigned short dst, unsigned char value, unsigned length);
+	void touch(unsigned short addr, unsigned length);
+	void startDMA(unsigned char source);
+	void endDMA();
+
+private:
+	void freeze(int index) const;
+	void unshare(int index);
+	void releaseShared();
+	void releaseBare();
+};
+
+std::atomic<unsigned long long> Memory::incarnations(0);
+
+Memory::Memory(PagePool *pool) : pool(pool){
+	memset(shared, 0, sizeof(shared));
+	memset(bare, 0, sizeof(bare));
+	memset(generations, 0, sizeof(generations));
+	memset(busy, 0xFF, sizeof(busy));
+	incarnation = ++incarnations;
+	rom = nullptr;
+	romSize = 0;
+	mbc = 0;
+	bank = 1;
+	dma = false;
+	dmaSource = 0;
+	mapPages();
+}
+
+/**
+ * Copies `other` as operator= does. The copy takes its own pages from the heap pool, whatever
+ * `other`'s pool is.
+ */
+Memory::Memory(const Memory &other) : pool(&PagePool::heap){
+	memset(shared, 0, sizeof(shared));
+	memset(bare, 0, sizeof(bare));
+	memset(generations, 0, sizeof(generations));
+	memset(busy, 0xFF, sizeof(busy));
+	*this = other;
+}
+
+Memory::~Memory(){
+	releaseShared();
+	releaseBare();
+}
+
+/**
+ * Copies `other` copy-on-write: both end up mapping the same shared pages, and only pages either
+ * side writes to later get copied. Pages of `other` that were still private are turned into shared
+ * pages first (from `other`'s pool), so only pages written since `other` was last copied cost a
+ * copy. This memory keeps its own pool. Must not run concurrently with `other` being stepped.
+ */
+Memory &Memory::operator=(const Memory &other){
+	if (this == &other){
+		return *this;
+	}
+	releaseShared();
+	for (int i = 0; i < 128; i++){
+		if (!other.shared[i]){
+			other.freeze(i);
+		}
+		shared[i] = other.shared[i];
+		shared[i]->refs++;
+	}
+	rom = other.rom;
+	romSize = other.romSize;
+	mbc = other.mbc;
+	bank = other.bank;
+	dma = other.dma;
+	dmaSource = other.dmaSource;
+	incarnation = ++incarnations;
+	mapPages();
+	for (int i = 0; i < 128 && !rom; i++){
+		memcpy(bare[i]->data, other.bare[i]->data, 256);
+	}
+	return *this;
+}
+
+/**
+ * Zeroes all memory and unmaps the cartridge.
+ */
+void Memory::clear(){
+	releaseShared();
+	memset(ram, 0, sizeof(ram));
+	for (int i = 0; i < 128 && bare[i]; i++){
+		memset(bare[i]->data, 0, 256);
+	}
+	incarnation = ++incarnations;
+	rom = nullptr;
+	romSize = 0;
+	mbc = 0;
+	bank = 1;
+	dma = false;
+	mapPages();
+}
+
+/**
+ * Maps `data` as the cartridge ROM. It isn't copied, so it must outlive this memory (and any copy of it).
+ * \return false if `data` is smaller than the 32KB ROM area.
+ */
+bool Memory::mapROM(const unsigned char *data, unsigned long size){
+	if (size < 0x8000){
+		return false;
+	}
+	rom = data;
+	romSize = size;
+	mbc = data[0x147];
+	bank = 1;
+	mapPages();
+	return true;
+}
+
+/**
+ * Handles a guest write to the ROM area: the MBC's ROM bank select.
+ * External RAM enable/banking isn't emulated, 0xA000-0xBFFF is always the instance's 8KB.
+ */
+void Memory::writeROM(unsigned short addr, unsigned char value){
+	if (!rom || addr < 0x2000 || addr >= 0x4000 || pages[addr >> 8] == busy){ // No MBC write while OAM DMA holds the bus
+		return;
+	}
+	if (mbc >= 0x01 && mbc <= 0x03){ // MBC1
+		bank = value & 0x1F;
+		if (bank == 0) bank = 1;
+	} else if (mbc >= 0x0F && mbc <= 0x13){ // MBC3
+		bank = value & 0x7F;
+		if (bank == 0) bank = 1;
+	} else if (mbc >= 0x19 && mbc <= 0x1E){ // MBC5, 9 bit bank number
+		bank = (addr < 0x3000)? ((bank & 0x100) | value):((bank & 0xFF) | ((value & 1) << 8));
+	} else {
+		return; // ROM only
+	}
+	bank %= romSize / 0x4000;
+	for (int page = 0x40; page < 0x80; page++){ // Only the switchable bank moves
+		pages[page] = const_cast<unsigned char *>(&rom[bank * 0x4000 + ((page - 0x40) << 8)]);
+	}
+}
+
+/**
+ * Rebuilds the page table from the current mapping, taking the `bare` pages (zeroed) when no
+ * cartridge is mapped and giving them back when one is.
+ */
+void Memory::mapPages(){
+	if (rom){
+		releaseBare();
+	}
+	for (int page = 0; page < 0x80; page++){
+		if (!rom){
+			if (!bare[page]){
+				bare[page] = pool->allocate();
+				memset(bare[page]->data, 0, 256);
+			}
+			pages[page] = bare[page]->data;
+		} else {
+			unsigned long offset = (page < 0x40)? (page << 8):(bank * 0x4000 + ((page - 0x40) << 8));
+			pages[page] = const_cast<unsigned char *>(&rom[offset]); // Only written through operator[], see above
+		}
+	}
+	for (int page = 0x80; page < 0x100; page++){
+		SharedPage *sharedPage = shared[page - 0x80];
+		pages[page] = sharedPage? sharedPage->data:&ram[(page - 0x80) << 8];
+	}
+	if (dma){ // OAM, and the bus the source is on: VRAM, or the external bus (cartridge and WRAM)
+		bool vram = dmaSource >= 0x80 && dmaSource < 0xA0;
+		for (int page = 0; page <= 0xFE; page++){
+			if (page == 0xFE || (page >= 0x80 && page < 0xA0) == vram){
+				pages[page] = busy;
+			}
+		}
+	}
+}
+
+/**
+ * Makes RAM pages `firstPage`-`lastPage` private, so the range is contiguous in `ram`.
+ */
+void Memory::own(unsigned char firstPage, unsigned char lastPage){
+	for (int page = firstPage; page <= lastPage; page++){
+		if (page >= 0x80 && shared[page - 0x80]){
+			unshare(page - 0x80);
+		}
+	}
+}
+
+/**
+ * Bumps the generation of every page [addr, addr + length) overlaps, as writing it would.
+ * An empty range touches nothing.
+ */
+void Memory::touch(unsigned short addr, unsigned length){
+	if (!length){
+		return;
+	}
+	for (unsigned page = addr >> 8; page <= (addr + length - 1u) >> 8; page++){
+		generations[page]++;
+	}
+}
+
+/**
+ * Bulk write() of `length` bytes read from `src` to RAM at `dst`. Neither range may wrap past
+ * 0xFFFF, and they must not overlap. Copying nothing is a no-op.
+ */
+void Memory::copy(unsigned short dst, unsigned short src, unsigned length){
+	if (!length){
+		return;
+	}
+	own(dst >> 8, (dst + length - 1) >> 8);
+	touch(dst, length);
+	unsigned char *out = &ram[dst - 0x8000];
+	while (length){
+		unsigned chunk = std::min(length, 0x100u - (src & 0xFF));
+		memcpy(out, &pages[src >> 8][src & 0xFF], chunk);
+		out += chunk;
+		src += chunk;
+		length -= chunk;
+	}
+}
+
+/**
+ * Bulk write() of `length` copies of `value` to RAM at `dst`, which may not wrap past 0xFFFF.
+ * Filling nothing is a no-op.
+ */
+void Memory::fill(unsigned short dst, unsigned char value, unsigned length){
+	if (!length){
+		return;
+	}
+	own(dst >> 8, (dst + length - 1) >> 8);
+	touch(dst, length);
+	memset(&ram[dst - 0x8000], value, length);
+}
+
+/**
+ * Starts OAM DMA from page `source`, as written to 0xFF46: the 160 bytes are copied to OAM
+ * (0xFE00) at once, then until endDMA() the CPU reads 0xFF from OAM and from the bus the source is
+ * on, and its writes there are dropped. Sources from 0xE0 up read WRAM, as on the DMG.
+ */
+void Memory::startDMA(unsigned char source){
+	if (dma){ // Restarted: the source is read with the bus free
+		endDMA();
+	}
+	dmaSource = (source >= 0xE0)? source - 0x20:source;
+	copy(0xFE00, dmaSource << 8, 0xA0);
+	memset(busy, 0xFF, sizeof(busy)); // In case a raw write landed in it last time
+	dma = true;
+	mapPages();
+}
+
+/**
+ * Gives the bus OAM DMA held back to the CPU.
+ */
+void Memory::endDMA(){
+	dma = false;
+	mapPages();
+}
+
+/**
+ * Moves private RAM page `index` into a shared page.
+ */
+void Memory::freeze(int index) const{
+	SharedPage *page = pool->allocate();
+	memcpy(page->data, &ram[index << 8], 256);
+	shared[index] = page;
+	if (pages[0x80 + index] != busy){
+		pages[0x80 + index] = page->data;
+	}
+}
+
+/**
+ * Copies shared page `index` back into `ram` and drops the reference to it.
+ */
+void Memory::unshare(int index){
+	SharedPage *page = shared[index];
+	memcpy(&ram[index << 8], page->data, 256);
+	shared[index] = nullptr;
+	if (pages[0x80 + index] != busy){
+		pages[0x80 + index] = &ram[index << 8];
+	}
+	PagePool::release(page);
+}
+
+void Memory::releaseShared(){
+	for (int i = 0; i < 128; i++){
+		if (shared[i]){
+			PagePool::release(shared[i]);
+			shared[i] = nullptr;
+		}
+	}
+}
+
+void Memory::releaseBare(){
+	for (int i = 0; i < 128 && bare[i]; i++){
+		PagePool::release(bare[i]);
+		bare[i] = nullptr;
+	}
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef PPU_HPP
+#define PPU_HPP
+
+#include <cstring>
+#include "CPU.hpp"
+
+/**
+ * PPU_MODE is the value the PPU reports in the lower 2 bits of STAT.
+ */
+enum PPU_MODE {HBLANK, VBLANK, OAM_SCAN, TRANSFER};
+
+/**
+ * Interrupt bits in IF / IE.
+ */
+#define vblankInterrupt	0b00000001
+#define statInterrupt	0b00000010
+#define joypadInterrupt	0b00010000
+
+class PPU {
+public:
+	unsigned char *framebuffer; // 160x144 shades (0-3), row major. nullptr when headless: only LY, STAT and interrupts are kept up to date
+	unsigned long long frames; // Number of VBlanks entered
+
+	Memory *memory; // Address space of the CPU the PPU is attached to
+
+	PPU_MODE mode;
+	unsigned char line; // Internal LY, keeps counting while the LCD is off
+	int dots; // T-cycles left until the next mode change
+	bool statLine; // STAT interrupt line, interrupts are requested on its rising edge
+
+	void initialize(Memory *memory);
+	void tick(int cycles);
+	unsigned long long cyclesToVBlank() const;
+	void nextMode();
+	void updateRegisters();
+	void renderLine();
+};
+
+void PPU::initialize(Memory *mem){
+	memory = mem;
+	framebuffer = nullptr;
+	frames = 0;
+	mode = OAM_SCAN;
+	line = 0;
+	dots = 80;
+	statLine = false;
+	updateRegisters();
+}
+
+/**
+ * Advances the PPU by `cycles` T-cycles.
+ * Only mode boundaries do any work, so ticking after every instruction is cheap.
+ */
+void PPU::tick(int cycles){
+	dots -= cycles;
+	while (dots <= 0){
+		nextMode();
+	}
+}
+
+/**
+ * \return the T-cycles until the next VBlank is entered (the next increment of `frames`).
+ */
+unsigned long long PPU::cyclesToVBlank() const{
+	if (mode == VBLANK){
+		return dots + (153 - line) * 456ULL + 144 * 456;
+	}
+	unsigned long long rest = (mode == OAM_SCAN)? 172 + 204:(mode == TRANSFER)? 204:0;
+	return dots + rest + (143 - line) * 456ULL;
+}
+
+/**
+ * Moves to the next mode: OAM scan (80) -> transfer (172) -> HBlank (204) for lines 0-143,
+ * then 10 lines of VBlank (456 each).
+ */
+void PPU::nextMode(){
+	switch (mode){
+		case OAM_SCAN: mode = TRANSFER; dots += 172; break;
+		case TRANSFER:
+			mode = HBLANK;
+			dots += 204;
+			if (framebuffer) renderLine();
+			break;
+		case HBLANK:
+			line++;
+			if (line == 144){
+				mode = VBLANK;
+				dots += 456;
+				frames++;
+				if ((*memory)[LCDC] & 0x80) memory->write(IF, (*memory)[IF] | vblankInterrupt);
+			} else {
+				mode = OAM_SCAN;
+				dots += 80;
+			}
+			break;
+		case VBLANK:
+			line++;
+			if (line == 154){
+				line = 0;
+				mode = OAM_SCAN;
+				dots += 80;
+			} else {
+				dots += 456;
+			}
+			break;
+	}
+	updateRegisters();
+}
+
+/**
+ * Publishes LY and STAT and requests the STAT interrupt on a rising edge of its line.
+ * While the LCD is off LY reads 0 and STAT reports HBlank.
+ */
+void PPU::updateRegisters(){
+	Memory &mem = *memory;
+	bool lcdOn = mem[LCDC] & 0x80;
+	unsigned char ly = lcdOn? line:0;
+	PPU_MODE shownMode = lcdOn? mode:HBLANK;
+	unsigned char stat = mem[STAT];
+	bool coincidence = ly == mem[LYC];
+
+	mem.write(LY, ly);
+	mem.write(STAT, 0x80 | (stat & 0b01111000) | (coincidence? 0b100:0) | shownMode);
+
+	bool newLine = lcdOn && (((stat & 0b00001000) && mode == HBLANK) ||
+		((stat & 0b00010000) && mode == VBLANK) ||
+		((stat & 0b00100000) && mode == OAM_SCAN) ||
+		((stat & 0b01000000) && coincidence));
+	if (newLine && !statLine){
+		mem.write(IF, mem[IF] | statInterrupt);
+	}
+	statLine = newLine;
+}
+
+/**
+ * Draws the background of the current line into the framebuffer.
+ */
+void PPU::renderLine(){
+	Memory &mem = *memory;
+	unsigned char lcdc = mem[LCDC];
+	unsigned char *row = &framebuffer[line * 160];
+	if (!(lcdc & 0x80) || !(lcdc & 0x01)){ // LCD or background disabled
+		memset(row, 0, 160);
+		return;
+	}
+	unsigned char y = line + mem[SCY];
+	unsigned short mapBase = (lcdc & 0x08)? 0x9C00:0x9800;
+	unsigned char palette = mem[BGP];
+	for (int x = 0; x < 160; x++){
+		unsigned char px = x + mem[SCX];
+		unsigned char tile = mem[mapBase + (y / 8) * 32 + px / 8];
+		unsigned short addr = (lcdc & 0x10)? 0x8000 + tile * 16 : 0x9000 + (signed char)tile * 16; // Unsigned / signed tile addressing
+		addr += (y % 8) * 2;
+		int bit = 7 - (px % 8);
+		unsigned char color = (((mem[addr + 1] >> bit) & 1) << 1) | ((mem[addr] >> bit) & 1);
+		row[x] = (palette >> (color * 2)) & 0b11;
+	}
+}
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+/**
+ * Guest profiler: counts executions per opcode, per CB opcode, per pair of adjacent opcodes run one
+ * after the other and per (bank, PC), and cycles per routine (the entry of the current call, see
+ * CallStack). Only compiled in when GB_PROFILE is
+ * defined; otherwise the hooks in Emulator::step don't exist at all.
+ *
+ * Counters are plain arrays owned by each thread, merged when the profile is written.
+ */
+#ifdef GB_PROFILE
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Sampler.hpp"
+
+/**
+ * Counters of one thread.
+ */
+struct ProfileCounters {
+	unsigned long long opcodes[256] = {};
+	unsigned long long cbOpcodes[256] = {};
+	std::vector<unsigned long long> pairs = std::vector<unsigned long long>(0x10000); // By first << 8 | second
+	unsigned char last = 0; // Last opcode
+	int lastEnd = -1; // Address after it, -1 if it can't pair with the next one
+	std::vector<unsigned long long> pcCount; // Executions per code key
+	std::vector<unsigned long long> pcCycles; // Cycles per code key
+	std::vector<unsigned> pcRoutine; // Routine a code key was last executed in
+	std::vector<unsigned long long> routineCycles; // Cycles per routine entry key
+
+	inline void grow(unsigned key){
+		if (key >= pcCount.size()){
+			size_t size = std::max((size_t)key + 0x4000, pcCount.size() * 2);
+			pcCount.resize(size);
+			pcCycles.resize(size);
+			pcRoutine.resize(size);
+			routineCycles.resize(size);
+		}
+	}
+};
+
+class Profiler {
+public:
+	static ProfileCounters &local();
+	static void record(CallStack &routines, const CPU &cpu, unsigned short pc, unsigned short bank, unsigned cycles);
+	static bool write(const char *reportPath, const char *foldedPath, const char *pairsPath);
+
+private:
+	static std::mutex lock;
+	static std::vector<std::unique_ptr<ProfileCounters>> threads; // Every thread's counters, kept after the thread exits
+};
+
+std::mutex Profiler::lock;
+std::vector<std::unique_ptr<ProfileCounters>> Profiler::threads;
+
+/**
+ * \return the calling thread's counters, registering them on first use.
+ */
+ProfileCounters &Profiler::local(){
+	thread_local ProfileCounters *counters = nullptr;
+	if (!counters){
+		std::lock_guard<std::mutex> guard(lock);
+		threads.emplace_back(new ProfileCounters());
+		counters = threads.back().get();
+	}
+	return *counters;
+}
+
+/**
+ * Counts the instruction `cpu` just executed.
+ * \param pc, bank Where it was fetched from.
+ */
+void Profiler::record(CallStack &routines, const CPU &cpu, unsigned short pc, unsigned short bank, unsigned cycles){
+	ProfileCounters &counters = local();
+	unsigned short opcode = cpu.opcode;
+	if (opcode <= 0xFF){
+		counters.opcodes[opcode]++;
+		if (pc == counters.lastEnd){ // Fell through from the last one, so the pair could be fused
+			counters.pairs[counters.last << 8 | opcode]++;
+		}
+		counters.last = opcode;
+		counters.lastEnd = (unsigned short)(pc + opcodeLengths[opcode]);
+	} else {
+		if ((opcode & 0xFF00) == 0xCB00){
+			counters.cbOpcodes[opcode & 0xFF]++;
+		}
+		counters.lastEnd = -1;
+	}
+	unsigned key = codeKey(pc, bank);
+	unsigned routine = routines.current();
+	counters.grow(std::max(key, routine));
+	counters.pcCount[key]++;
+	counters.pcCycles[key] += cycles;
+	counters.pcRoutine[key] = routine;
+	counters.routineCycles[routine] += cycles;
+	routines.update(opcode, pc, cpu.PC, bank, cpu.SP);
+}
+
+/**
+ * Merges every thread's counters and writes a sorted text report, folded stacks
+ * ("routine;pc cycles" lines, input for flamegraph.pl) and the most frequent opcode pairs
+ * ("first second count" lines, input for BlockCache::loadFusions).
+ */
+bool Profiler::write(const char *reportPath, const char *foldedPath, const char *pairsPath){
+	std::lock_guard<std::mutex> guard(lock);
+	ProfileCounters total;
+	for (const std::unique_ptr<ProfileCounters> &counters : threads){
+		for (int i = 0; i < 256; i++){
+			total.opcodes[i] += counters->opcodes[i];
+			total.cbOpcodes[i] += counters->cbOpcodes[i];
+		}
+		for (int i = 0; i < 0x10000; i++){
+			total.pairs[i] += counters->pairs[i];
+		}
+		if (!counters->pcCount.empty()) total.grow(counters->pcCount.size() - 1);
+		for (size_t key = 0; key < counters->pcCount.size(); key++){
+			total.pcCount[key] += counters->pcCount[key];
+			total.pcCycles[key] += counters->pcCycles[key];
+			total.routineCycles[key] += counters->routineCycles[key];
+			if (counters->pcCount[key]) total.pcRoutine[key] = counters->pcRoutine[key];
+		}
+	}
+
+	FILE *report = fopen(reportPath, "w");
+	FILE *folded = fopen(foldedPath, "w");
+	FILE *pairs = fopen(pairsPath, "w");
+	if (!report || !folded || !pairs){
+		if (report) fclose(report);
+		if (folded) fclose(folded);
+		if (pairs) fclose(pairs);
+		return false;
+	}
+	unsigned long long instructions = 0, cycles = 0;
+	for (int i = 0; i < 256; i++){
+		instructions += total.opcodes[i] + total.cbOpcodes[i];
+	}
+	for (unsigned long long c : total.pcCycles){
+		cycles += c;
+	}
+	fprintf(report, "instructions: %llu\ncycles: %llu\n", instructions, cycles);
+
+	auto section = [&](const char *title, const std::vector<unsigned long long> &values, const char *format, size_t limit){
+		std::vector<unsigned> order;
+		for (size_t i = 0; i < values.size(); i++){
+			if (values[i]) order.push_back(i);
+		}
+		std::sort(order.begin(), order.end(), [&values](unsigned a, unsigned b){ return values[a] > values[b]; });
+		unsigned long long sum = 0;
+		for (unsigned i : order) sum += values[i];
+		fprintf(report, "\n%s\n", title);
+		for (size_t i = 0; i < order.size() && i < limit; i++){
+			char name[16];
+			if (format){
+				snprintf(name, sizeof(name), format, order[i]);
+			} else {
+				formatKey(name, sizeof(name), order[i]);
+			}
+			fprintf(report, "  %-10s %14llu %6.2f%%\n", name, values[order[i]], 100.0 * values[order[i]] / sum);
+		}
+	};
+	section("opcodes (executions)", std::vector<unsigned long long>(total.opcodes, total.opcodes + 256), "0x%02X", 256);
+	section("cb opcodes (executions)", std::vector<unsigned long long>(total.cbOpcodes, total.cbOpcodes + 256), "0xCB%02X", 256);
+	section("opcode pairs (executions)", total.pairs, "0x%04X", 32);
+	section("hot PCs (cycles)", total.pcCycles, nullptr, 100);
+	section("routines (cycles)", total.routineCycles, nullptr, 100);
+
+	for (size_t key = 0; key < total.pcCycles.size(); key++){
+		if (total.pcCycles[key]){
+			char routine[16], pc[16];
+			formatKey(routine, sizeof(routine), total.pcRoutine[key]);
+			formatKey(pc, sizeof(pc), key);
+			fprintf(folded, "%s;%s %llu\n", routine, pc, total.pcCycles[key]);
+		}
+	}
+
+	std::vector<unsigned> order;
+	for (unsigned pair = 0; pair < 0x10000; pair++){
+		if (total.pairs[pair]) order.push_back(pair);
+	}
+	std::sort(order.begin(), order.end(), [&total](unsigned a, unsigned b){ return total.pairs[a] > total.pairs[b]; });
+	fprintf(pairs, "; first second executions\n");
+	for (size_t i = 0; i < order.size() && i < 64; i++){
+		fprintf(pairs, "%02X %02X %llu\n", order[i] >> 8, order[i] & 0xFF, total.pairs[order[i]]);
+	}
+	fclose(report);
+	fclose(folded);
+	fclose(pairs);
+	return true;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CPU.hpp"
+
+/**
+ * Compact key of a code address: PCs outside the switchable bank map to themselves,
+ * 0x4000-0x7FFF of bank n maps to 0x10000 + n * 0x4000 + offset.
+ */
+inline unsigned codeKey(unsigned short pc, unsigned short bank){
+	return (pc >= 0x4000 && pc < 0x8000)? 0x10000 + bank * 0x4000 + (pc - 0x4000):pc;
+}
+
+/**
+ * Prints `key` as bank:address.
+ */
+inline void formatKey(char *out, size_t size, unsigned key){
+	if (key < 0x10000){
+		snprintf(out, size, "%02X:%04X", 0, key);
+	} else {
+		snprintf(out, size, "%02X:%04X", (key - 0x10000) / 0x4000, 0x4000 + (key - 0x10000) % 0x4000);
+	}
+}
+
+/**
+ * CALL_KIND classifies opcodes for the shadow call stack.
+ */
+enum CALL_KIND {NO_CALL, CALL, CALL_CC, RST, RET, RET_CC};
+
+static const unsigned char callKinds[256] = {
+	// 0x00-0xBF never call or return
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	RET_CC, 0, 0, 0, CALL_CC, 0, 0, RST, RET_CC, RET, 0, 0, CALL_CC, CALL, 0, RST, // 0xC*
+	RET_CC, 0, 0, 0, CALL_CC, 0, 0, RST, RET_CC, RET, 0, 0, CALL_CC, 0, 0, RST, // 0xD*
+	0, 0, 0, 0, 0, 0, 0, RST, 0, 0, 0, 0, 0, 0, 0, RST, // 0xE*
+	0, 0, 0, 0, 0, 0, 0, RST, 0, 0, 0, 0, 0, 0, 0, RST // 0xF*
+};
+
+/**
+ * Shadow call stack of one emulator, following CALL/RST/RET and interrupt entry.
+ * Frames remember SP after the call, so a RET also drops frames whose stack space a routine
+ * released by hand (e.g. popping its return address and jumping).
+ */
+class CallStack {
+public:
+	struct Frame {
+		unsigned entry; // Code key of the routine's first instruction
+		unsigned short sp; // SP right after the return address was pushed
+	};
+
+	std::vector<Frame> frames; // Entry point at the bottom
+
+	void reset(unsigned entry = 0x0100);
+	inline unsigned current() const { return frames.back().entry; }
+	void update(unsigned short opcode, unsigned short pc, unsigned short newPC, unsigned short bank, unsigned short sp);
+	void interrupt(unsigned short vector, unsigned short sp);
+
+private:
+	void push(unsigned entry, unsigned short sp);
+};
+
+void CallStack::reset(unsigned entry){
+	frames.assign(1, {entry, 0xFFFF});
+}
+
+/**
+ * Follows the opcode just executed (or the interrupt entered, see INTERRUPT_ENTRY). Conditional
+ * calls/returns only count when PC didn't fall through to the next instruction.
+ * \param pc, bank Where the opcode was fetched from.
+ * \param newPC, sp Registers after it executed.
+ */
+void CallStack::update(unsigned short opcode, unsigned short pc, unsigned short newPC, unsigned short bank, unsigned short sp){
+	if (opcode >= INTERRUPT_ENTRY){
+		interrupt(newPC, sp);
+		return;
+	}
+	if (opcode > 0xFF){ // CB opcodes share the table index of their second byte, but never call
+		return;
+	}
+	switch (callKinds[opcode]){
+		case NO_CALL: break;
+		case CALL_CC: if (newPC == (unsigned short)(pc + 3)) break; // fallthrough
+		case CALL: case RST: push(codeKey(newPC, bank), sp); break;
+		case RET_CC: if (newPC == (unsigned short)(pc + 1)) break; // fallthrough
+		case RET:
+			while (frames.size() > 1 && frames.back().sp < sp){
+				frames.pop_back();
+			}
+			break;
+	}
+}
+
+/**
+ * Enters the handler at `vector` for an interrupt (SP after the return address was pushed).
+ */
+void CallStack::interrupt(unsigned short vector, unsigned short sp){
+	push(vector, sp);
+}
+
+void CallStack::push(unsigned entry, unsigned short sp){
+	if (frames.size() < 1024){ // Runaway recursion (or code that never returns) shouldn't grow forever
+		frames.push_back({entry, sp});
+	}
+}
+
+/**
+ * Samples the guest call stack every `period` guest cycles and writes the samples as folded stacks
+ * ("outer;inner count" lines, input for flamegraph.pl), naming routines from a .sym file if given.
+ * Attach to an emulator through Emulator::sampler.
+ */
+class Sampler {
+public:
+	CallStack calls;
+	unsigned long long period; // Guest cycles between samples
+	unsigned long long next; // Cycle count of the next sample
+
+	Sampler(unsigned long long period = 4096);
+
+	/**
+	 * Follows the instruction `cpu` just executed (fetched at pc in bank) and samples if due.
+	 * Kept to a table lookup and a compare for everything but calls, returns and samples.
+	 */
+	inline void step(const CPU &cpu, unsigned short pc, unsigned short bank){
+		if (callKinds[cpu.opcode & 0xFF] || cpu.opcode >= INTERRUPT_ENTRY){
+			calls.update(cpu.opcode, pc, cpu.PC, bank, cpu.SP);
+		}
+		if (cpu.cycles >= next){
+			sample(cpu.cycles);
+		}
+	}
+
+	bool loadSymbols(const char *path);
+	bool write(const char *path);
+
+private:
+	struct StackLess {
+		bool operator()(const std::vector<CallStack::Frame> &a, const std::vector<CallStack::Frame> &b) const {
+			return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(),
+				[](const CallStack::Frame &x, const CallStack::Frame &y){ return x.entry < y.entry; });
+		}
+	};
+	std::map<std::vector<CallStack::Frame>, unsigned long long, StackLess> samples;
+	std::unordered_map<unsigned, std::string> symbols; // Code key -> routine name
+
+	void sample(unsigned long long cycles);
+	std::string name(unsigned key);
+};
+
+Sampler::Sampler(unsigned long long samplePeriod) : period(samplePeriod), next(samplePeriod){
+	calls.reset();
+}
+
+void Sampler::sample(unsigned long long cycles){
+	next = cycles - cycles % period + period; // Stay on the period's grid rather than drift with instruction lengths
+	samples[calls.frames]++;
+}
+
+/**
+ * Loads routine names from a .sym file ("bank:address name" lines, ';' starts a comment).
+ * \return false if the file can't be read.
+ */
+bool Sampler::loadSymbols(const char *path){
+	std::ifstream file(path);
+	if (!file){
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)){
+		line = line.substr(0, line.find(';'));
+		unsigned bank, addr;
+		char label[256];
+		if (sscanf(line.c_str(), "%x:%x %255s", &bank, &addr, label) == 3){
+			symbols[codeKey(addr, bank)] = label;
+		}
+	}
+	return true;
+}
+
+std::string Sampler::name(unsigned key){
+	auto found = symbols.find(key);
+	if (found != symbols.end()){
+		return found->second;
+	}
+	char formatted[16];
+	formatKey(formatted, sizeof(formatted), key);
+	return formatted;
+}
+
+bool Sampler::write(const char *path){
+	FILE *out = fopen(path, "w");
+	if (!out){
+		return false;
+	}
+	for (const auto &sample : samples){
+		std::string stack;
+		for (const CallStack::Frame &frame : sample.first){
+			if (!stack.empty()) stack += ';';
+			stack += name(frame.entry);
+		}
+		fprintf(out, "%s %llu\n", stack.c_str(), sample.second);
+	}
+	fclose(out);
+	return true;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work-stealing thread pool.
+ * Every worker owns a deque: it pops its own work from the front and, once empty,
+ * steals from the back of the other workers' deques so long jobs don't leave cores idle.
+ */
+class ThreadPool {
+public:
+	ThreadPool(unsigned threads = 0);
+	~ThreadPool();
+
+	unsigned size() const { return workers.size(); }
+
+	void submit(std::function<void()> task);
+	void wait();
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<Queue> queues;
+	std::atomic<unsigned> next; // Queue the next submitted task goes to
+	std::atomic<unsigned long> queued; // Tasks sitting in a queue
+	std::atomic<unsigned long> pending; // Submitted tasks that haven't finished
+
+	std::mutex sleepLock;
+	std::condition_variable wake; // Signalled on submit and shutdown
+	std::condition_variable done; // Signalled when pending reaches 0
+	bool stopping;
+
+	bool pop(unsigned self, std::function<void()> &task);
+	void work(unsigned self);
+};
+
+/**
+ * \param threads Number of workers, 0 for one per core.
+ */
+ThreadPool::ThreadPool(unsigned threads) : queues(threads? threads:std::max(1u, std::thread::hardware_concurrency())), next(0), queued(0), pending(0), stopping(false){
+	for (unsigned i = 0; i < queues.size(); i++){
+		workers.emplace_back(&ThreadPool::work, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread &worker : workers){
+		worker.join();
+	}
+}
+
+/**
+ * Queues `task`, spreading tasks round-robin over the workers.
+ */
+void ThreadPool::submit(std::function<void()> task){
+	Queue &queue = queues[next++ % queues.size()];
+	pending++;
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.tasks.push_back(std::move(task));
+	}
+	queued++;
+	{
+		std::lock_guard<std::mutex> guard(sleepLock); // Don't let a worker miss the wake up between its check and wait
+	}
+	wake.notify_one();
+}
+
+/**
+ * Blocks until every submitted task has finished.
+ */
+void ThreadPool::wait(){
+	std::unique_lock<std::mutex> guard(sleepLock);
+	done.wait(guard, [this]{ return pending == 0; });
+}
+
+/**
+ * Takes a task from the worker's own queue, or steals one from another worker.
+ */
+bool ThreadPool::pop(unsigned self, std::function<void()> &task){
+	for (unsigned i = 0; i < queues.size(); i++){
+		Queue &queue = queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (!queue.tasks.empty()){
+			if (i == 0){
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			} else {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::work(unsigned self){
+	std::function<void()> task;
+	while (true){
+		if (pop(self, task)){
+			task();
+			task = nullptr;
+			if (--pending == 0){
+				std::lock_guard<std::mutex> guard(sleepLock);
+				done.notify_all();
+			}
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(sleepLock);
+		wake.wait(guard, [this]{ return stopping || queued > 0; });
+		if (stopping && queued == 0){
+			return;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "CPU.hpp"
+
+/**
+ * One traced instruction: the registers before it executed and the 4 bytes at PC, as in a
+ * gameboy-doctor log line, plus the cycle count.
+ */
+struct TraceRecord {
+	unsigned long long cycles;
+	unsigned short AF, BC, DE, HL, SP, PC;
+	unsigned char pcmem[4]; // pcmem[0] is the opcode
+};
+
+/**
+ * Header of a dumped trace file, followed by `count` records oldest first.
+ */
+struct TraceHeader {
+	char magic[4]; // "GBTR"
+	unsigned version;
+	unsigned recordSize;
+	unsigned reserved;
+	unsigned long long count; // Records in the file
+	unsigned long long recorded; // Records traced in total, older ones were overwritten
+};
+
+static const unsigned traceVersion = 1;
+
+/**
+ * Ring buffer of the last `capacity` instructions of one emulator, attached through
+ * Emulator::trace. Only the emulator's thread writes; the head is published with release
+ * ordering so another thread can dump the ring, though the oldest records may be overwritten
+ * while it copies them.
+ */
+class Trace {
+public:
+	const char *faultPath; // Dumped here when the CPU faults, if set
+
+	Trace(size_t capacity = 1 << 16);
+
+	inline void record(CPU &cpu){
+		unsigned long long n = head.load(std::memory_order_relaxed);
+		TraceRecord &r = ring[n & mask];
+		r.cycles = cpu.cycles;
+		r.AF = cpu.AF;
+		r.BC = cpu.BC;
+		r.DE = cpu.DE;
+		r.HL = cpu.HL;
+		r.SP = cpu.SP;
+		r.PC = cpu.PC;
+		if ((cpu.PC & 0xFF) <= 0xFC){ // All 4 bytes on one page
+			memcpy(r.pcmem, &cpu.memory[cpu.PC], 4);
+		} else {
+			for (int i = 0; i < 4; i++){
+				r.pcmem[i] = cpu.memory[cpu.PC + i];
+			}
+		}
+		head.store(n + 1, std::memory_order_release);
+	}
+
+	/**
+	 * Drops the last record, for a step that turned out not to execute an instruction.
+	 */
+	inline void retract(){
+		head.store(head.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+	}
+
+	inline unsigned long long recorded() const { return head.load(std::memory_order_acquire); }
+	size_t size() const;
+	const TraceRecord &operator[](size_t i) const; // i-th oldest record still in the ring
+
+	bool dump(const char *path) const;
+	void faulted();
+
+private:
+	std::vector<TraceRecord> ring;
+	size_t mask;
+	std::atomic<unsigned long long> head; // Records written so far
+	bool dumped; // faulted() already wrote faultPath
+};
+
+/**
+ * \param capacity Rounded up to a power of two.
+ */
+Trace::Trace(size_t capacity) : faultPath(nullptr), head(0), dumped(false){
+	size_t size = 1;
+	while (size < capacity){
+		size <<= 1;
+	}
+	ring.resize(size);
+	mask = size - 1;
+}
+
+size_t Trace::size() const {
+	unsigned long long n = recorded();
+	return n < ring.size()? n:ring.size();
+}
+
+const TraceRecord &Trace::operator[](size_t i) const {
+	return ring[(recorded() - size() + i) & mask];
+}
+
+/**
+ * Writes the ring oldest first through a shared mapping of `path`.
+ * \return false if the file can't be created or mapped.
+ */
+bool Trace::dump(const char *path) const {
+	size_t count = size();
+	size_t length = sizeof(TraceHeader) + count * sizeof(TraceRecord);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0){
+		return false;
+	}
+	if (ftruncate(fd, length) != 0){
+		close(fd);
+		return false;
+	}
+	void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED){
+		return false;
+	}
+	TraceHeader header = {{'G', 'B', 'T', 'R'}, traceVersion, sizeof(TraceRecord), 0, count, recorded()};
+	memcpy(mapping, &header, sizeof(header));
+	TraceRecord *records = (TraceRecord *)((char *)mapping + sizeof(header));
+	size_t first = (header.recorded - count) & mask; // Oldest record, the copy wraps around once
+	size_t tail = std::min(count, ring.size() - first);
+	memcpy(records, &ring[first], tail * sizeof(TraceRecord));
+	memcpy(records + tail, &ring[0], (count - tail) * sizeof(TraceRecord));
+	munmap(mapping, length);
+	return true;
+}
+
+/**
+ * Called once the CPU faults: dumps to faultPath the first time.
+ */
+void Trace::faulted(){
+	if (faultPath && !dumped){
+		dumped = true;
+		if (!dump(faultPath)){
+			fprintf(stderr, "Could not write trace: %s\n", faultPath);
+		}
+	}
+}
+
+/**
+ * Prints `r` as a gameboy-doctor log line (no newline).
+ */
+inline int formatDoctor(char *out, size_t size, const TraceRecord &r){
+	return snprintf(out, size, "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X",
+		r.AF >> 8, r.AF & 0xFF, r.BC >> 8, r.BC & 0xFF, r.DE >> 8, r.DE & 0xFF, r.HL >> 8, r.HL & 0xFF,
+		r.SP, r.PC, r.pcmem[0], r.pcmem[1], r.pcmem[2], r.pcmem[3]);
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef WORKLOADS_HPP
+#define WORKLOADS_HPP
+
+#include <string>
+#include <vector>
+#include "Emulator.hpp"
+
+/**
+ * A deterministic synthetic ROM used as a reproducible macro-benchmark.
+ */
+struct Workload {
+	std::string name;
+	std::vector<unsigned char> rom;
+	unsigned long long frames; // How many frames a benchmark run lasts
+	bool render; // Draw into a framebuffer while running
+	unsigned long long expectedHash; // Emulator::stateHash() after `frames` frames
+};
+
+/**
+ * Builds a ROM of `banks` 16KB banks with `program` at 0x0150, reached from the entry point with a JR.
+ * \param type Cartridge type written at 0x147 (0x00 ROM only, 0x01 MBC1, ...).
+ */
+std::vector<unsigned char> makeROM(const std::vector<unsigned char> &program, unsigned char type = 0x00, int banks = 2){
+	std::vector<unsigned char> rom(banks * 0x4000, 0x00);
+	rom[0x0100] = 0x00; // NOP
+	rom[0x0101] = 0x18; // JR 0x0150
+	rom[0x0102] = 0x0150 - 0x0103;
+	const char title[] = "SYNTHETIC";
+	for (size_t i = 0; i < sizeof(title) - 1; i++){
+		rom[0x0134 + i] = title[i];
+	}
+	rom[0x0147] = type;
+	rom[0x0148] = 0x00;
+	while ((2 << rom[0x0148]) < banks){ // ROM size: 32KB << n
+		rom[0x0148]++;
+	}
+	unsigned char checksum = 0;
+	for (int i = 0x0134; i <= 0x014C; i++){
+		checksum = checksum - rom[i] - 1;
+	}
+	rom[0x014D] = checksum;
+	for (size_t i = 0; i < program.size(); i++){
+		rom[0x0150 + i] = program[i];
+	}
+	return rom;
+}
+
+/**
+ * The standard workloads. Every program loops forever, the benchmark stops it after `frames` frames.
+ */
+std::vector<Workload> workloads(){
+	std::vector<Workload> list;
+
+	// Byte copy loop: 256 bytes from ROM to WRAM, over and over
+	std::vector<unsigned char> memcpyROM = makeROM({
+		0x21, 0x00, 0x10, // 0x150 LD HL, 0x1000
+		0x11, 0x00, 0xC0, // 0x153 LD DE, 0xC000
+		0x06, 0x00, // 0x156 LD B, 0 (256 iterations)
+		0x2A, // 0x158 LD A, (HL+)
+		0x12, // 0x159 LD (DE), A
+		0x13, // 0x15A INC DE
+		0x05, // 0x15B DEC B
+		0x20, 0xFA, // 0x15C JR NZ, 0x158
+		0x18, 0xF0 // 0x15E JR 0x150
+	});
+	for (int i = 0; i < 0x100; i++){
+		memcpyROM[0x1000 + i] = (i * 7 + 3) & 0xFF;
+	}
+	list.push_back({"memcpy", memcpyROM, 600, false, 0x25162537BE42C5F9});
+
+	// 16-bit arithmetic kernel around ADD HL, dd
+	list.push_back({"arith", makeROM({
+		0x21, 0x00, 0x00, // 0x150 LD HL, 0
+		0x01, 0x34, 0x12, // 0x153 LD BC, 0x1234
+		0x11, 0x0F, 0x0F, // 0x156 LD DE, 0x0F0F
+		0x31, 0x01, 0x01, // 0x159 LD SP, 0x0101
+		0x09, // 0x15C ADD HL, BC
+		0x19, // ADD HL, DE
+		0x29, // ADD HL, HL
+		0x39, // ADD HL, SP
+		0x03, // INC BC
+		0x1B, // DEC DE
+		0x04, // INC B
+		0x0D, // DEC C
+		0x07, // RLCA
+		0x17, // RLA
+		0x0F, // RRCA
+		0x38, 0x01, // 0x167 JR C, 0x16A
+		0x33, // 0x169 INC SP
+		0x18, 0xF0 // 0x16A JR 0x15C
+	}), 600, false, 0xDC12B9E19BA4A0BC});
+
+	// MBC1 bank switch every 10 instructions, reading from each bank
+	std::vector<unsigned char> bankROM = makeROM({
+		0x21, 0x00, 0xC0, // 0x150 LD HL, 0xC000 (bank counter)
+		0x01, 0x00, 0x20, // 0x153 LD BC, 0x2000 (MBC1 ROM bank select)
+		0x11, 0x00, 0x40, // 0x156 LD DE, 0x4000
+		0x34, // 0x159 INC (HL)
+		0x2A, // LD A, (HL+)
+		0x2B, // DEC HL
+		0x02, // LD (BC), A
+		0x1A, // LD A, (DE)
+		0x13, // INC DE
+		0x1A, // LD A, (DE)
+		0x23, // INC HL
+		0x32, // LD (HL-), A
+		0x18, 0xF2 // 0x162 JR 0x156
+	}, 0x01, 4);
+	for (int bank = 1; bank < 4; bank++){
+		for (int i = 0; i < 0x4000; i++){
+			bankROM[bank * 0x4000 + i] = (bank * 0x11 + i) & 0xFF;
+		}
+	}
+	list.push_back({"banking", bankROM, 600, false, 0x0EF4026B3C791997});
+
+	// Fills tile data while scrolling, with the background being drawn
+	list.push_back({"vram", makeROM({
+		0x21, 0x00, 0x80, // 0x150 LD HL, 0x8000
+		0x11, 0x43, 0xFF, // 0x153 LD DE, SCX
+		0x0E, 0x18, // 0x156 LD C, 0x18 (0x1800 bytes of tiles)
+		0x06, 0x00, // 0x158 LD B, 0
+		0x22, // 0x15A LD (HL+), A
+		0x17, // RLA
+		0x05, // DEC B
+		0x20, 0xFB, // 0x15D JR NZ, 0x15A
+		0x12, // 0x15F LD (DE), A
+		0x0D, // DEC C
+		0x20, 0xF5, // 0x161 JR NZ, 0x158
+		0x18, 0xEB // 0x163 JR 0x150
+	}), 600, true, 0xC60E6C2D94EF36C3});
+
+	return list;
+}
+
+/**
+ * Powers `emulator` on with the ROM of `workload`.
+ * \param framebuffer Where to draw if the workload renders.
+ */
+void loadWorkload(const Workload &workload, Emulator &emulator, unsigned char *framebuffer){
+	emulator.initialize();
+	emulator.loadROM(workload.rom.data(), workload.rom.size());
+	emulator.ppu.framebuffer = workload.render? framebuffer:nullptr;
+}
+
+/**
+ * Runs `workload` from power on for its number of frames.
+ * \param framebuffer Where to draw if the workload renders.
+ */
+void runWorkload(const Workload &workload, Emulator &emulator, unsigned char *framebuffer){
+	loadWorkload(workload, emulator, framebuffer);
+	emulator.runFrames(workload.frames);
+}
+
+#endif
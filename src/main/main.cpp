@@ -1,7 +1,298 @@
 #include <iostream>
-#include "CPU.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <dlfcn.h>
+#include "Emulator.hpp"
+#include "Batch.hpp"
+#include "CodeMap.hpp"
+#include "Lockstep.hpp"
+#include "Workloads.hpp"
 using namespace std;
 
-int main (){
+static Emulator emulator;
+
+/**
+ * Runs every job of a manifest (see BatchJob) and writes the results as JSON lines.
+ * Usage: gameboy --batch <manifest> <output> [--threads N]
+ */
+int runBatch (int argc, char *argv[]){
+    if (argc < 4){
+        cerr << "Usage: " << argv[0] << " --batch <manifest> <output> [--threads N]" << endl;
+        return 1;
+    }
+    unsigned threads = 0;
+    if (argc >= 6 && strcmp(argv[4], "--threads") == 0){
+        threads = strtoul(argv[5], nullptr, 10);
+    }
+    Batch batch;
+    if (!batch.parse(argv[2])){
+        cerr << batch.error << endl;
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    if (!batch.run(argv[3], threads)){
+        cerr << batch.error << endl;
+        return 1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("jobs: %zu (%.1f jobs/sec)\n", batch.jobs.size(), batch.jobs.size() / seconds);
+    return 0;
+}
+
+/**
+ * Writes every synthetic workload ROM into `dir`, with a batch manifest and the expected hashes.
+ * Usage: gameboy --workloads <dir>
+ */
+int writeWorkloads (const char *dir){
+    string manifestPath = string(dir) + "/manifest.txt";
+    ofstream manifest(manifestPath);
+    ofstream expected(string(dir) + "/expected.txt");
+    if (!manifest || !expected){
+        cerr << "Could not write to " << dir << endl;
+        return 1;
+    }
+    for (const Workload &workload : workloads()){
+        string romPath = string(dir) + "/" + workload.name + ".gb";
+        ofstream rom(romPath, ios::binary);
+        rom.write((const char *)workload.rom.data(), workload.rom.size());
+        manifest << romPath << " frames=" << workload.frames << " hash" << endl;
+        char hash[32];
+        snprintf(hash, sizeof(hash), "0x%016llX", workload.expectedHash);
+        expected << workload.name << " " << hash << endl;
+    }
+    printf("wrote %s\n", manifestPath.c_str());
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Runs every synthetic workload under each engine: the interpreter, decoded blocks with and without
+ * superinstructions, and `lanes` emulators in lockstep. Prints each engine's throughput (summed over
+ * the lockstep lanes) and checks that every engine ends in the workload's expected state hash.
+ * Usage: gameboy --bench
+ */
+int runBench (){
+    static unsigned char framebuffer[144 * 160];
+    const size_t lanes = 16; // One AVX2 vector
+    const char *engines[] = {"interpret", "blocks", "unfused", "lockstep"};
+    bool allMatch = true;
+    for (const Workload &workload : workloads()){
+        for (const char *engine : engines){
+            vector<unique_ptr<Emulator>> emulators;
+            emulators.emplace_back(new Emulator());
+            while (strcmp(engine, "lockstep") == 0 && emulators.size() < lanes){
+                emulators.emplace_back(new Emulator());
+            }
+            vector<Emulator *> running;
+            for (unique_ptr<Emulator> &emulator : emulators){
+                loadWorkload(workload, *emulator, framebuffer);
+                running.push_back(emulator.get());
+            }
+            BlockCache blocks;
+            if (strcmp(engine, "unfused") == 0){
+                blocks.clearFusions();
+            }
+            if (strcmp(engine, "blocks") == 0 || strcmp(engine, "unfused") == 0){
+                running[0]->blocks = &blocks;
+            }
+
+            auto start = chrono::steady_clock::now();
+            if (strcmp(engine, "lockstep") == 0){
+                Lockstep lockstep;
+                lockstep.attach(running);
+                while (any_of(running.begin(), running.end(), [&](Emulator *lane){ return lane->ppu.frames < workload.frames && !lane->cpu.fault; })){
+                    lockstep.step();
+                }
+                lockstep.store();
+            } else {
+                running[0]->runFrames(workload.frames);
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            unsigned long long frames = 0;
+            unsigned long long instructions = 0;
+            bool match = true;
+            for (Emulator *emulator : running){
+                frames += emulator->ppu.frames;
+                instructions += emulator->instructions;
+                match = match && emulator->stateHash() == workload.expectedHash;
+            }
+            allMatch = allMatch && match;
+            printf("%-10s %-10s %8.1f frames/sec %12.0f instructions/sec  %s\n", workload.name.c_str(), engine,
+                frames / seconds, instructions / seconds, match? "ok":"HASH MISMATCH");
+        }
+    }
+    return allMatch? 0:2;
+}
+
+/**
+ * Headless runner: runs a ROM as fast as possible with no video, audio or pacing.
+ * --sample N samples the guest call stack every N cycles into samples.folded, with routine names
+ * from --sym if given. --trace keeps the last instructions and dumps them to `file` at the end or
+ * on a fault (decode with trace_decode). --engine blocks runs decoded ROM blocks (see BlockCache)
+ * instead of stepping one instruction at a time, with the same results. Blocks of the ROM's code map
+ * (<rom>.codemap, written there on first use, see CodeMap) are decoded before running. --fuse limits
+ * its superinstructions to the opcode pairs listed in `file` (the profile.pairs of a profiling build).
+ * --plugin runs the blocks engine with the blocks of a ROM recompiled by the recompile tool.
+ * Usage: gameboy <rom> [--frames N | --cycles N] [--sample N] [--sym file] [--trace file] [--engine interpret|blocks] [--fuse file] [--plugin file]
+ */
+int run (int argc, char *argv[]){
+    if (argc < 2){
+        cerr << "Usage: " << argv[0] << " <rom> [--frames N | --cycles N] [--sample N] [--sym file] [--trace file] [--engine interpret|blocks] [--fuse file] [--plugin file]" << endl;
+        cerr << "       " << argv[0] << " --batch <manifest> <output> [--threads N]" << endl;
+        cerr << "       " << argv[0] << " --workloads <dir>" << endl;
+        cerr << "       " << argv[0] << " --bench" << endl;
+        return 1;
+    }
+    if (strcmp(argv[1], "--batch") == 0){
+        return runBatch(argc, argv);
+    }
+    if (strcmp(argv[1], "--workloads") == 0 && argc >= 3){
+        return writeWorkloads(argv[2]);
+    }
+    if (strcmp(argv[1], "--bench") == 0){
+        return runBench();
+    }
+    unsigned long long frames = 600;
+    unsigned long long cycles = 0; // Takes priority over frames when set
+    unsigned long long samplePeriod = 0; // No sampling when 0
+    const char *symbols = nullptr;
+    const char *tracePath = nullptr;
+    bool useBlocks = false;
+    const char *fusionsPath = nullptr;
+    const char *pluginPath = nullptr;
+    const char *options[] = {"--frames", "--cycles", "--sample", "--sym", "--trace", "--engine", "--fuse", "--plugin"};
+    for (int i = 2; i < argc; i += 2){
+        if (find_if(begin(options), end(options), [&](const char *option){ return strcmp(argv[i], option) == 0; }) == end(options)){
+            cerr << "Unknown option: " << argv[i] << endl;
+            return 1;
+        }
+        if (i + 1 == argc){
+            cerr << "Missing value for option: " << argv[i] << endl;
+            return 1;
+        }
+        if (strcmp(argv[i], "--frames") == 0){
+            frames = strtoull(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--cycles") == 0){
+            cycles = strtoull(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--sample") == 0){
+            samplePeriod = strtoull(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--sym") == 0){
+            symbols = argv[i + 1];
+        } else if (strcmp(argv[i], "--trace") == 0){
+            tracePath = argv[i + 1];
+        } else if (strcmp(argv[i], "--engine") == 0){
+            if (strcmp(argv[i + 1], "blocks") != 0 && strcmp(argv[i + 1], "interpret") != 0){
+                cerr << "Unknown engine: " << argv[i + 1] << endl;
+                return 1;
+            }
+            useBlocks = strcmp(argv[i + 1], "blocks") == 0;
+        } else if (strcmp(argv[i], "--fuse") == 0){
+            fusionsPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--plugin") == 0){
+            pluginPath = argv[i + 1];
+            useBlocks = true;
+        }
+    }
+
+    if (pluginPath && fusionsPath){ // Both paths of a run must fuse the same pairs
+        cerr << "--fuse can't be combined with --plugin: compiled blocks fuse the default opcode pairs" << endl;
+        return 1;
+    }
+
+    vector<unsigned char> rom;
+    emulator.initialize(); // Headless: the PPU has no framebuffer to draw into
+    if (!readROM(argv[1], rom) || !emulator.loadROM(rom.data(), rom.size())){
+        cerr << "Could not load ROM: " << argv[1] << endl;
+        return 1;
+    }
+    unique_ptr<Sampler> sampler;
+    if (samplePeriod){
+        sampler.reset(new Sampler(samplePeriod));
+        if (symbols && !sampler->loadSymbols(symbols)){
+            cerr << "Could not read symbols: " << symbols << endl;
+        }
+        emulator.sampler = sampler.get();
+    }
+    unique_ptr<Trace> trace;
+    if (tracePath){
+        trace.reset(new Trace());
+        trace->faultPath = tracePath;
+        emulator.trace = trace.get();
+    }
+    unique_ptr<BlockCache> blocks;
+    if (useBlocks){
+        blocks.reset(new BlockCache());
+        if (fusionsPath && !blocks->loadFusions(fusionsPath)){
+            cerr << "Could not read opcode pairs: " << fusionsPath << endl;
+        }
+        emulator.blocks = blocks.get();
+        CodeMap codeMap;
+        string codeMapPath = string(argv[1]) + ".codemap";
+        if (!codeMap.load(codeMapPath.c_str())){
+            codeMap.analyze(rom.data(), rom.size());
+            if (!codeMap.write(codeMapPath.c_str())){
+                cerr << "Could not write code map: " << codeMapPath << endl;
+            }
+        }
+        size_t prewarmed = codeMap.prewarm(*blocks, emulator.cpu.memory);
+        printf("code map: %zu blocks, %lu bytes of code (%zu decoded ahead)\n", codeMap.blocks.size(), codeMap.codeBytes(), prewarmed);
+        if (pluginPath){
+            void *plugin = dlopen(pluginPath, RTLD_NOW | RTLD_LOCAL); // Stays loaded until exit
+            auto compiledROM = plugin? (const CompiledROM *(*)())dlsym(plugin, "gbCompiledROM"):nullptr;
+            if (!compiledROM){
+                cerr << "Could not load plugin: " << dlerror() << endl;
+                return 1;
+            }
+            size_t attached = blocks->attach(*compiledROM(), emulator.cpu.memory);
+            if (!attached){
+                cerr << "Plugin " << pluginPath << " was compiled from a different ROM" << endl;
+            }
+            printf("compiled blocks: %zu\n", attached);
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    if (cycles){
+        emulator.runCycles(cycles);
+    } else {
+        emulator.runFrames(frames);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    printf("frames: %llu (%.1f frames/sec)\n", emulator.ppu.frames, emulator.ppu.frames / seconds);
+    printf("instructions: %llu (%.0f instructions/sec)\n", emulator.instructions, emulator.instructions / seconds);
+    printf("cycles: %llu\n", emulator.cpu.cycles);
+    printf("state hash: 0x%016llX\n", emulator.stateHash());
+    if (blocks){
+        printf("blocks: %zu (%llu lookups, %llu of %llu returns predicted, %llu loop iterations in bulk, %llu invalidated)\n", blocks->size(), blocks->lookups, blocks->returnHits, blocks->returns, blocks->loopIterations, blocks->invalidations);
+    }
+    if (sampler && !sampler->write("samples.folded")){
+        cerr << "Could not write samples.folded" << endl;
+    }
+    if (trace && !emulator.cpu.fault && !trace->dump(tracePath)){
+        cerr << "Could not write trace: " << tracePath << endl;
+    }
+    if (emulator.cpu.fault){
+        fprintf(stderr, "Unknown opcode 0x%X at 0x%04X\n", emulator.cpu.opcode, emulator.cpu.PC);
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * Profiling builds (-DGB_PROFILE) write profile.txt, profile.folded and profile.pairs when the
+ * run ends.
+ */
+int main (int argc, char *argv[]){
+    int status = run(argc, argv);
+#ifdef GB_PROFILE
+    if (!Profiler::write("profile.txt", "profile.folded", "profile.pairs")){
+        cerr << "Could not write the profile" << endl;
+    }
+#endif
+    return status;
+}
@@ -0,0 +1,908 @@
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+#include "../main/Emulator.hpp"
+#include "../main/Env.hpp"
+#include "../main/Arena.hpp"
+#include "../main/Workloads.hpp"
+#include "../main/CodeMap.hpp"
+
+struct EmulatorTest{
+    Emulator emulator;
+    std::vector<unsigned char> rom;
+    EmulatorTest() : rom(0x8000, 0x00){
+        // JR -2 loop so the CPU never leaves 0x0100
+        rom[0x0100] = 0x18;
+        rom[0x0101] = 0xFE;
+        emulator.initialize();
+        emulator.loadROM(rom.data(), rom.size());
+    }
+};
+
+TEST_CASE_METHOD(EmulatorTest, "LY advances every 456 cycles and VBlank is requested at line 144") {
+    emulator.cpu.memory[IF] = 0x00;
+    emulator.runCycles(456);
+    REQUIRE(emulator.cpu.memory[LY] == 1);
+    emulator.runCycles(456 * 142);
+    REQUIRE(emulator.cpu.memory[LY] == 143);
+    REQUIRE((emulator.cpu.memory[IF] & vblankInterrupt) == 0);
+    emulator.runCycles(456);
+    REQUIRE(emulator.cpu.memory[LY] == 144);
+    REQUIRE((emulator.cpu.memory[STAT] & 0b11) == VBLANK);
+    REQUIRE((emulator.cpu.memory[IF] & vblankInterrupt) != 0);
+    REQUIRE(emulator.ppu.frames == 1);
+}
+
+TEST_CASE_METHOD(EmulatorTest, "STAT interrupt on LY == LYC") {
+    emulator.cpu.memory[IF] = 0x00;
+    emulator.cpu.memory[LYC] = 10;
+    emulator.cpu.memory[STAT] = 0b01000000; // LYC interrupt enabled
+    emulator.runCycles(456 * 9);
+    REQUIRE((emulator.cpu.memory[IF] & statInterrupt) == 0);
+    emulator.runCycles(456);
+    REQUIRE(emulator.cpu.memory[LY] == 10);
+    REQUIRE((emulator.cpu.memory[STAT] & 0b100) != 0);
+    REQUIRE((emulator.cpu.memory[IF] & statInterrupt) != 0);
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Headless run keeps timing identical to a rendered run") {
+    Emulator *headless = new Emulator();
+    headless->initialize();
+    headless->loadROM(rom.data(), rom.size());
+    unsigned char screen[144 * 160];
+    emulator.ppu.framebuffer = screen;
+    emulator.runFrames(3);
+    headless->runFrames(3);
+    REQUIRE(headless->cpu.cycles == emulator.cpu.cycles);
+    REQUIRE(headless->stateHash() == emulator.stateHash());
+    delete headless;
+}
+
+TEST_CASE_METHOD(EmulatorTest, "P1 reports the pressed buttons of the selected group") {
+    emulator.cpu.memory[IF] = 0x00;
+    emulator.setButtons(0b10000001); // Start, Right
+    REQUIRE((emulator.cpu.memory[IF] & joypadInterrupt) != 0);
+    emulator.cpu.storeReg(0x20, P1); // Select directions
+    REQUIRE(emulator.cpu.memory[P1] == 0xEE);
+    emulator.cpu.storeReg(0x10, P1); // Select actions
+    REQUIRE(emulator.cpu.memory[P1] == 0xD7);
+    emulator.cpu.storeReg(0x30, P1); // Nothing selected
+    REQUIRE(emulator.cpu.memory[P1] == 0xFF);
+}
+
+TEST_CASE("Env reset restores the snapshot and stepMany matches stepping one by one") {
+    std::vector<unsigned char> rom(0x8000, 0x00);
+    rom[0x0100] = 0x04; // INC B
+    rom[0x0101] = 0x18; // JR -3
+    rom[0x0102] = 0xFD;
+    std::vector<Env *> envs, reference;
+    for (int i = 0; i < 6; i++){
+        envs.push_back(new Env(rom.data(), rom.size()));
+        reference.push_back(new Env(rom.data(), rom.size()));
+    }
+    Observation first = envs[0]->reset();
+    unsigned long long startHash = envs[0]->emulator.stateHash();
+
+    ThreadPool pool(3);
+    std::vector<unsigned char> actions = {0x00, 0x01, 0x10, 0x80, 0x00, 0x0F};
+    Env::stepMany(envs, actions, 4, pool);
+    for (int i = 0; i < 6; i++){
+        reference[i]->step(actions[i], 4);
+        REQUIRE(envs[i]->emulator.stateHash() == reference[i]->emulator.stateHash());
+        REQUIRE(envs[i]->emulator.ppu.frames == 4);
+    }
+
+    Observation again = envs[0]->reset();
+    REQUIRE(again.framebuffer == first.framebuffer); // Same buffers, nothing copied
+    REQUIRE(again.wram == &envs[0]->emulator.cpu.memory[0xC000]);
+    REQUIRE(envs[0]->emulator.stateHash() == startHash);
+    for (int i = 0; i < 6; i++){
+        delete envs[i];
+        delete reference[i];
+    }
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Guest writes to ROM select the bank instead of changing the ROM") {
+    std::vector<unsigned char> banked(0x10000, 0x00);
+    banked[0x0147] = 0x01; // MBC1
+    banked[0x4000] = 0x11;
+    banked[0x8000] = 0x22;
+    banked[0xC000] = 0x33;
+    emulator.loadROM(banked.data(), banked.size());
+    REQUIRE(emulator.cpu.memory[0x4000] == 0x11);
+    emulator.cpu.storeReg(0x03, 0x2000);
+    REQUIRE(emulator.cpu.memory[0x4000] == 0x33);
+    emulator.cpu.storeReg(0x00, 0x2100); // Bank 0 selects bank 1
+    REQUIRE(emulator.cpu.memory[0x4000] == 0x11);
+    REQUIRE(banked[0x2100] == 0x00);
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Arena instances share the ROM and reuse freed slots") {
+    Arena arena(4);
+    REQUIRE(arena.capacity == 4);
+    Emulator *first = arena.create(rom.data(), rom.size());
+    Emulator *second = arena.create(rom.data(), rom.size());
+    REQUIRE(first != nullptr);
+    REQUIRE(second != nullptr);
+    REQUIRE(first->cpu.memory.pages[0x01] == second->cpu.memory.pages[0x01]); // Same ROM page
+    REQUIRE(first->cpu.memory.pages[0xC0] != second->cpu.memory.pages[0xC0]); // Own WRAM
+    first->runFrames(2);
+    emulator.runFrames(2);
+    REQUIRE(first->stateHash() == emulator.stateHash());
+    arena.destroy(first);
+    Emulator *third = arena.create(rom.data(), rom.size());
+    REQUIRE(third == first);
+    REQUIRE(arena.live == 2);
+    REQUIRE(arena.create(rom.data(), 0x100) == nullptr); // ROM too small
+    REQUIRE(arena.live == 2);
+
+    Emulator *child = arena.fork(third); // Shares pages carved out of the arena, not the heap
+    REQUIRE(child != nullptr);
+    REQUIRE(child->cpu.memory.shared[0x40] == third->cpu.memory.shared[0x40]);
+    REQUIRE(child->cpu.memory.shared[0x40]->pool == third->cpu.memory.pool);
+    REQUIRE(third->cpu.memory.pool != &PagePool::heap);
+    child->runFrames(1);
+    third->runFrames(1);
+    REQUIRE(child->stateHash() == third->stateHash());
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Forked children share pages copy-on-write and run independently") {
+    emulator.runFrames(1);
+    Emulator *child = new Emulator();
+    emulator.fork(*child);
+    REQUIRE(child->stateHash() == emulator.stateHash());
+    REQUIRE(child->cpu.memory.pages[0xC0] == emulator.cpu.memory.pages[0xC0]); // Shared until written
+
+    child->cpu.storeReg(0x42, 0xC000);
+    REQUIRE(child->cpu.memory[0xC000] == 0x42);
+    REQUIRE(emulator.cpu.memory[0xC000] == 0x00);
+    REQUIRE(child->cpu.memory.pages[0xC0] != emulator.cpu.memory.pages[0xC0]);
+    REQUIRE(child->cpu.memory.pages[0xC1] == emulator.cpu.memory.pages[0xC1]);
+
+    emulator.cpu.storeReg(0x24, 0xC100);
+    REQUIRE(child->cpu.memory[0xC100] == 0x00);
+
+    Emulator *reference = new Emulator();
+    reference->initialize();
+    reference->loadROM(rom.data(), rom.size());
+    reference->runFrames(1);
+    reference->cpu.storeReg(0x42, 0xC000);
+    child->runFrames(2);
+    reference->runFrames(2);
+    REQUIRE(child->stateHash() == reference->stateHash());
+    delete child;
+    delete reference;
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Forked children don't record into their parent's trace") {
+    Trace trace;
+    emulator.trace = &trace;
+    emulator.runFrames(1);
+    unsigned long long recorded = trace.recorded();
+    REQUIRE(recorded > 0);
+
+    Emulator *child = new Emulator();
+    emulator.fork(*child);
+    REQUIRE(child->trace == nullptr);
+    REQUIRE(emulator.trace == &trace);
+    child->runFrames(1);
+    REQUIRE(trace.recorded() == recorded);
+
+    Trace childTrace;
+    child->trace = &childTrace;
+    emulator.fork(*child); // Forking again keeps what the child has attached
+    REQUIRE(child->trace == &childTrace);
+    delete child;
+    emulator.trace = nullptr;
+}
+
+TEST_CASE("Synthetic workloads end in their expected state") {
+    Emulator *emulator = new Emulator();
+    unsigned char framebuffer[144 * 160];
+    for (const Workload &workload : workloads()){
+        runWorkload(workload, *emulator, framebuffer);
+        INFO(workload.name);
+        REQUIRE_FALSE(emulator->cpu.fault);
+        REQUIRE(emulator->stateHash() == workload.expectedHash);
+    }
+    delete emulator;
+}
+
+TEST_CASE("Call stack follows calls, skipped conditions and unwound returns") {
+    CallStack calls;
+    calls.reset();
+    calls.update(0xCD, 0x0150, 0x2000, 1, 0xFFFC); // CALL 0x2000
+    calls.update(0xC4, 0x2000, 0x2003, 1, 0xFFFC); // CALL NZ not taken
+    REQUIRE(calls.frames.size() == 2);
+    calls.update(0xCD, 0x2003, 0x4800, 3, 0xFFFA); // CALL into bank 3
+    calls.interrupt(0x0040, 0xFFF8);
+    REQUIRE(calls.current() == 0x0040);
+    calls.update(0xD9, 0x0045, 0x4810, 3, 0xFFFA); // RETI
+    REQUIRE(calls.current() == codeKey(0x4800, 3));
+    calls.update(0xC9, 0x4820, 0x0160, 3, 0xFFFE); // RET past a discarded return address
+    REQUIRE(calls.frames.size() == 1);
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Sampler writes folded stacks named from symbols") {
+    const char *symbols = "sampler_test.sym";
+    FILE *file = fopen(symbols, "w");
+    fprintf(file, "; comment\n00:0100 Entry\n");
+    fclose(file);
+
+    Sampler sampler(1000);
+    REQUIRE(sampler.loadSymbols(symbols));
+    emulator.sampler = &sampler;
+    emulator.runCycles(100000);
+    REQUIRE(sampler.write("sampler_test.folded"));
+
+    std::ifstream folded("sampler_test.folded");
+    std::string stack;
+    unsigned long long count;
+    REQUIRE(folded >> stack >> count);
+    REQUIRE(stack == "Entry");
+    REQUIRE(count == 100);
+    remove(symbols);
+    remove("sampler_test.folded");
+}
+
+TEST_CASE("Trace keeps the last instructions and dumps them on a fault") {
+    std::vector<unsigned char> rom(0x8000, 0x00);
+    rom[0x0100] = 0x04; // INC B
+    rom[0x0101] = 0x04;
+    rom[0x0102] = 0xD3; // Not an opcode
+    Emulator *emulator = new Emulator();
+    emulator->initialize();
+    emulator->loadROM(rom.data(), rom.size());
+    Trace trace(2);
+    trace.faultPath = "trace_test.bin";
+    emulator->trace = &trace;
+    emulator->runFrames(1);
+    REQUIRE(emulator->cpu.fault);
+    REQUIRE(emulator->cpu.PC == 0x0102);
+    REQUIRE(trace.recorded() == 3);
+    REQUIRE(trace.size() == 2);
+    REQUIRE(trace[0].PC == 0x0101);
+    REQUIRE(trace[1].pcmem[0] == 0xD3);
+
+    FILE *file = fopen("trace_test.bin", "rb");
+    REQUIRE(file);
+    TraceHeader header;
+    TraceRecord records[2];
+    REQUIRE(fread(&header, sizeof(header), 1, file) == 1);
+    REQUIRE(fread(records, sizeof(TraceRecord), 2, file) == 2);
+    fclose(file);
+    remove("trace_test.bin");
+    REQUIRE(header.count == 2);
+    REQUIRE(header.recorded == 3);
+    char line[128];
+    formatDoctor(line, sizeof(line), records[1]);
+    REQUIRE(std::string(line) == "A:01 F:10 B:02 C:13 D:00 E:D8 H:01 L:4D SP:FFFE PC:0102 PCMEM:D3,00,00,00");
+    delete emulator;
+}
+
+TEST_CASE_METHOD(EmulatorTest, "Interrupts enter their handler after EI's delay and wake HALT") {
+    rom[0x0100] = 0xFB; // EI
+    rom[0x0101] = 0x04; // INC B
+    rom[0x0102] = 0x76; // HALT
+    rom[0x0103] = 0x18; // JR -3
+    rom[0x0104] = 0xFD;
+    rom[0x0040] = 0x0C; // INC C
+    rom[0x0041] = 0xD9; // RETI
+    emulator.cpu.memory[IE] = vblankInterrupt;
+    emulator.cpu.memory[IF] = vblankInterrupt;
+    emulator.step(); // EI
+    emulator.step(); // INC B still runs before the interrupt
+    REQUIRE(emulator.cpu.BC == 0x0113);
+    emulator.step();
+    REQUIRE(emulator.cpu.opcode == (INTERRUPT_ENTRY | 0x40));
+    REQUIRE(emulator.cpu.PC == 0x0040);
+    REQUIRE(emulator.cpu.SP == 0xFFFC);
+    REQUIRE(emulator.cpu.memory[0xFFFC] == 0x02);
+    REQUIRE(emulator.cpu.memory[0xFFFD] == 0x01);
+    REQUIRE((emulator.cpu.memory[IF] & vblankInterrupt) == 0);
+    REQUIRE_FALSE(emulator.cpu.ime);
+    emulator.step(); // INC C
+    emulator.step(); // RETI
+    REQUIRE(emulator.cpu.PC == 0x0102);
+    REQUIRE(emulator.cpu.ime);
+    emulator.step(); // HALT
+    unsigned long long halted = emulator.cpu.cycles;
+    emulator.step();
+    REQUIRE(emulator.cpu.halted);
+    REQUIRE(emulator.cpu.PC == 0x0103);
+    REQUIRE(emulator.cpu.cycles == halted + 4);
+    emulator.runFrames(1);
+    emulator.step(); // VBlank wakes the CPU and enters the handler
+    REQUIRE_FALSE(emulator.cpu.halted);
+    REQUIRE(emulator.cpu.PC == 0x0040);
+    REQUIRE(emulator.cpu.memory[0xFFFC] == 0x03);
+
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+        run->cpu.memory[IE] = vblankInterrupt;
+    }
+    blocks->blocks = &cache;
+    blocks->runFrames(5);
+    stepped->runFrames(5);
+    REQUIRE(blocks->cpu.C() == 0x13 + 5); // The VBlank left requested at boot, then 4 frames (the 5th is still pending)
+    REQUIRE(blocks->stateHash() == stepped->stateHash());
+    delete blocks;
+    delete stepped;
+}
+
+TEST_CASE("Block cache matches stepping and predicts returns from its shadow stack") {
+    Emulator *emulator = new Emulator();
+    unsigned char framebuffer[144 * 160];
+    BlockCache cache;
+    for (const Workload &workload : workloads()){
+        cache.reset();
+        runWorkload(workload, *emulator, framebuffer);
+        unsigned long long expected = emulator->stateHash();
+        emulator->initialize();
+        emulator->loadROM(workload.rom.data(), workload.rom.size());
+        emulator->ppu.framebuffer = workload.render? framebuffer:nullptr;
+        emulator->blocks = &cache;
+        emulator->runFrames(workload.frames);
+        INFO(workload.name);
+        REQUIRE(emulator->stateHash() == expected);
+    }
+
+    std::vector<unsigned char> program(0xB2, 0x00);
+    unsigned char loop[] = {
+        0xCD, 0x00, 0x02, // 0x150 CALL 0x0200
+        0xCD, 0x00, 0x02, // 0x153 CALL 0x0200
+        0x18, 0xF8, // 0x156 JR -8
+    };
+    std::copy(loop, loop + sizeof(loop), program.begin());
+    program[0xB0] = 0x04; // 0x200 INC B
+    program[0xB1] = 0xC9; // 0x201 RET
+    std::vector<unsigned char> rom = makeROM(program);
+    cache.reset();
+    emulator->initialize();
+    emulator->loadROM(rom.data(), rom.size());
+    emulator->blocks = &cache;
+    emulator->runFrames(2);
+    unsigned long long hash = emulator->stateHash();
+    REQUIRE(cache.returns > 1000);
+    REQUIRE(cache.returnHits == cache.returns - 2); // Each call site resolves its return block once
+    emulator->initialize();
+    emulator->loadROM(rom.data(), rom.size());
+    emulator->runFrames(2);
+    REQUIRE(emulator->stateHash() == hash);
+    delete emulator;
+}
+
+TEST_CASE("Flag liveness picks flags-dead handlers and runs stay exact at any stop") {
+    std::vector<unsigned char> rom = makeROM({
+        0x04, // 0x150 INC B
+        0x0C, // 0x151 INC C
+        0x19, // 0x152 ADD HL, DE
+        0x15, // 0x153 DEC D
+        0x20, 0xFA, // 0x154 JR NZ, -6
+        0x3C, // 0x156 INC A
+        0x77, // 0x157 LD (HL), A
+        0x3C, // 0x158 INC A
+        0x18, 0xF5, // 0x159 JR -11
+    });
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+
+    Block *loop = cache.lookup(blocks->cpu.memory, 0x0150);
+    REQUIRE(loop->ops.size() == 5);
+    REQUIRE(loop->ops[0].fast == deadFlagsHandlers[0x04]); // Every flag INC writes is written again before JR reads Z
+    REQUIRE(loop->ops[1].fast == deadFlagsHandlers[0x0C]);
+    REQUIRE(loop->ops[2].live == cFlag); // Unlike ADD HL's carry: DEC keeps it and it's live on exit
+    REQUIRE(loop->ops[2].fast == loop->ops[2].handler);
+    REQUIRE(loop->ops[3].live == allFlags);
+    Block *store = cache.lookup(blocks->cpu.memory, 0x0156);
+    REQUIRE(store->ops[1].live == allFlags); // The block may stop after the store, so F must be exact there
+    REQUIRE(store->ops[0].fast == store->ops[0].handler);
+
+    for (int chunk = 0; chunk < 500; chunk++){ // Odd amounts, to stop inside blocks
+        blocks->runCycles(1237);
+        stepped->runCycles(1237);
+        if (blocks->stateHash() != stepped->stateHash()){
+            FAIL("diverged after chunk " << chunk);
+        }
+    }
+    REQUIRE(blocks->instructions == stepped->instructions);
+    delete blocks;
+    delete stepped;
+}
+
+TEST_CASE("Superinstructions leave the same state as the instructions they fuse") {
+    CPU *fused = new CPU();
+    CPU *stepped = new CPU();
+    unsigned seed = 7;
+    auto next = [&seed]{ seed = seed * 1103515245 + 12345; return (unsigned short)(seed >> 8); };
+    for (const Superinstruction &pair : superinstructions){
+        for (int trial = 0; trial < 64; trial++){
+            unsigned short regs[] = {next(), next(), (unsigned short)(0xC100 + next() % 0x1000), (unsigned short)(0xD100 + next() % 0x1000)};
+            unsigned char e = next();
+            for (CPU *cpu : {fused, stepped}){
+                cpu->initialize();
+                cpu->memory.clear();
+                cpu->AF = regs[0] & 0xFFF0;
+                cpu->BC = (trial & 1)? regs[1]:(regs[1] & 0xFF01); // Also reach 0 after DEC
+                cpu->DE = regs[2];
+                cpu->HL = regs[3];
+                cpu->PC = 0xC000;
+                cpu->memory[0xC000] = pair.first;
+                cpu->memory[0xC001] = pair.second;
+                cpu->memory[0xC002] = e;
+                cpu->memory[cpu->DE] = regs[0] >> 3;
+                cpu->memory[cpu->HL] = regs[1] >> 5;
+            }
+            pair.handler(*fused, pair.first);
+            stepped->step();
+            stepped->step();
+            INFO("pair " << (int)pair.first << " " << (int)pair.second);
+            REQUIRE(fused->AF == stepped->AF);
+            REQUIRE(fused->BC == stepped->BC);
+            REQUIRE(fused->DE == stepped->DE);
+            REQUIRE(fused->HL == stepped->HL);
+            REQUIRE(fused->PC == stepped->PC);
+            REQUIRE(fused->cycles == stepped->cycles);
+            REQUIRE(fused->opcode == stepped->opcode);
+            REQUIRE(memcmp(fused->memory.ram, stepped->memory.ram, sizeof(fused->memory.ram)) == 0);
+        }
+    }
+    delete fused;
+    delete stepped;
+}
+
+TEST_CASE("The block decoder fuses the configured opcode pairs") {
+    std::vector<unsigned char> rom = makeROM({
+        0x2A, // 0x150 LD A, (HL+)
+        0x12, // 0x151 LD (DE), A
+        0x13, // 0x152 INC DE
+        0x05, // 0x153 DEC B
+        0x20, 0xFA, // 0x154 JR NZ, -6
+        0x18, 0xF8, // 0x156 JR -8
+    });
+    Memory memory;
+    memory.mapROM(rom.data(), rom.size());
+    BlockCache cache;
+    Block *loop = cache.lookup(memory, 0x0150);
+    REQUIRE(loop->ops.size() == 5);
+    REQUIRE(loop->fastOps.size() == 3);
+    REQUIRE(loop->fastOps[0].handler == copyIncFused);
+    REQUIRE(loop->fastOps[0].check); // Stops may follow the store it ends with
+    REQUIRE(loop->fastOps[2].index == 3);
+
+    const char *path = "fusions_test.pairs";
+    std::ofstream pairs(path);
+    pairs << "; first second executions" << std::endl << "05 20 100" << std::endl << "12 13 90" << std::endl;
+    pairs.close();
+    REQUIRE(cache.loadFusions(path));
+    cache.reset();
+    loop = cache.lookup(memory, 0x0150);
+    REQUIRE(loop->fastOps.size() == 4);
+    REQUIRE(loop->fastOps[3].handler == decJumpFused<0>);
+    std::remove(path);
+
+    cache.clearFusions();
+    cache.reset();
+    REQUIRE(cache.lookup(memory, 0x0150)->fastOps.size() == 5);
+}
+
+TEST_CASE("Copy and fill loops run in bulk and stop exactly where stepping would") {
+    std::vector<unsigned char> rom = makeROM({
+        0x21, 0x00, 0x10, // 0x150 LD HL, 0x1000
+        0x11, 0x00, 0xC0, // 0x153 LD DE, 0xC000
+        0x06, 0x00, // 0x156 LD B, 0
+        0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, // 0x158 copy B bytes (256)
+        0x21, 0x00, 0xC0, // 0x15E LD HL, 0xC000
+        0x11, 0x00, 0xD0, // 0x161 LD DE, 0xD000
+        0x01, 0x00, 0x03, // 0x164 LD BC, 0x0300
+        0x2A, 0x12, 0x13, 0x0B, 0x78, 0xB1, 0x20, 0xF8, // 0x167 copy BC bytes
+        0x21, 0x00, 0xD8, // 0x16F LD HL, 0xD800
+        0x3E, 0x5A, // 0x172 LD A, 0x5A
+        0x06, 0x80, // 0x174 LD B, 0x80
+        0x22, 0x05, 0x20, 0xFC, // 0x176 fill B bytes
+        0x21, 0x00, 0xE0, // 0x17A LD HL, 0xE000
+        0x01, 0x23, 0x01, // 0x17D LD BC, 0x0123
+        0x7B, 0x22, 0x0B, 0x78, 0xB1, 0x20, 0xF9, 0x00, // 0x180 fill BC bytes with E
+        0x21, 0x10, 0xC0, // 0x188 LD HL, 0xC010
+        0x11, 0x11, 0xC0, // 0x18B LD DE, 0xC011
+        0x06, 0x20, // 0x18E LD B, 0x20
+        0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, // 0x190 overlapping copy, stepped
+        0x21, 0xF0, 0xFE, // 0x196 LD HL, 0xFEF0
+        0x06, 0x20, // 0x199 LD B, 0x20
+        0x22, 0x05, 0x20, 0xFC, // 0x19B fill into the IO registers, stepped
+        0x18, 0xAF, // 0x19F JR 0x0150
+    });
+    for (int i = 0; i < 0x100; i++){
+        rom[0x1000 + i] = i * 7;
+    }
+    std::vector<unsigned char> framebuffer[2] = {std::vector<unsigned char>(160 * 144), std::vector<unsigned char>(160 * 144)};
+
+    for (bool rendered : {false, true}){
+        Emulator *blocks = new Emulator();
+        Emulator *stepped = new Emulator();
+        BlockCache cache;
+        for (Emulator *run : {blocks, stepped}){
+            run->initialize();
+            run->loadROM(rom.data(), rom.size());
+            if (rendered){
+                run->ppu.framebuffer = framebuffer[run == blocks].data();
+                run->cpu.ime = true; // The VBlank handler is NOPs back into the program
+                run->cpu.memory[IE] = vblankInterrupt;
+            }
+        }
+        blocks->blocks = &cache;
+        REQUIRE(cache.lookup(blocks->cpu.memory, 0x0158)->loop == COPY_B);
+        REQUIRE(cache.lookup(blocks->cpu.memory, 0x0167)->loop == COPY_BC);
+        REQUIRE(cache.lookup(blocks->cpu.memory, 0x0176)->loop == FILL_B);
+        REQUIRE(cache.lookup(blocks->cpu.memory, 0x0180)->loop == FILL_BC);
+
+        for (int chunk = 0; chunk < 200; chunk++){
+            blocks->runCycles(4999);
+            stepped->runCycles(4999);
+            if (blocks->stateHash() != stepped->stateHash()){
+                FAIL("diverged after chunk " << chunk << (rendered? " rendered":""));
+            }
+        }
+        blocks->runFrames(3);
+        stepped->runFrames(3);
+        REQUIRE(blocks->stateHash() == stepped->stateHash());
+        REQUIRE(blocks->instructions == stepped->instructions);
+        REQUIRE(framebuffer[0] == framebuffer[1]);
+#ifndef GB_PROFILE // Profiles run every instruction on its own
+        REQUIRE(cache.loopIterations > 0);
+#endif
+        delete blocks;
+        delete stepped;
+    }
+
+    Memory *source = new Memory();
+    Memory *copy = new Memory();
+    for (int i = 0; i < 0x400; i++){
+        source->write(0xD000 + i, i);
+    }
+    *copy = *source;
+    unsigned char untouched = (*source)[0xC0F0];
+    copy->copy(0xC0F0, 0xD0F8, 0x210); // Across pages on both sides, into and out of shared ones
+    copy->fill(0xD300, 0xEE, 0x20);
+    REQUIRE((*copy)[0xC0F0] == 0xF8);
+    REQUIRE((*copy)[0xC2FF] == (unsigned char)0x307);
+    REQUIRE((*copy)[0xD31F] == 0xEE);
+    REQUIRE((*source)[0xD31F] == 0x1F);
+    REQUIRE((*source)[0xC0F0] == untouched);
+
+    unsigned generations[256];
+    memcpy(generations, copy->generations, sizeof(generations));
+    copy->copy(0xC000, 0xD000, 0); // Empty ranges change nothing
+    copy->fill(0xC000, 0xEE, 0);
+    copy->touch(0x0000, 0);
+    REQUIRE(memcmp(generations, copy->generations, sizeof(generations)) == 0);
+    delete source;
+    delete copy;
+}
+
+TEST_CASE("Code map finds the blocks reachable from the entry point and vectors") {
+    std::vector<unsigned char> rom = makeROM({
+        0xCD, 0x60, 0x01, // 0x150 CALL 0x0160
+        0x28, 0x03, // 0x153 JR Z, 0x0158
+        0xC3, 0x50, 0x01, // 0x155 JP 0x0150
+        0xDF, // 0x158 RST 0x18
+        0xC3, 0x50, 0x01, // 0x159 JP 0x0150
+        0xDD, 0xDD, 0xDD, 0xDD, // 0x15C data
+        0xCD, 0x00, 0x40, // 0x160 CALL 0x4000
+        0xC9, // 0x163 RET
+    });
+    rom[0x0018] = 0xC9; // RET
+    rom[0x4000] = 0xAF; // XOR A
+    rom[0x4001] = 0xC9; // RET
+
+    CodeMap map;
+    map.analyze(rom.data(), rom.size());
+    for (unsigned key : {0x0150, 0x0153, 0x0155, 0x0158, 0x0159, 0x0160, 0x0163, 0x0018}){
+        INFO("block " << key);
+        REQUIRE(map.blocks.count(key));
+    }
+    REQUIRE(map.blocks[0x0153] == 2);
+    REQUIRE(map.blocks[codeKey(0x4000, 1)] == 2);
+    REQUIRE(!map.blocks.count(0x015C));
+    REQUIRE(map.codeBytes() == 25 + (0x0103 - 0x0020) + 12 + 4 + 2); // Vector NOPs, entry, program, bank 1
+
+    const char *path = "codemap_test.codemap";
+    REQUIRE(map.write(path));
+    CodeMap loaded;
+    REQUIRE(loaded.load(path));
+    REQUIRE(loaded.blocks == map.blocks);
+    std::remove(path);
+
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+    REQUIRE(loaded.prewarm(cache, blocks->cpu.memory) == map.blocks.size());
+    REQUIRE(cache.size() == map.blocks.size());
+    REQUIRE(cache.lookups == 0);
+    blocks->runFrames(2);
+    stepped->runFrames(2);
+    REQUIRE(blocks->stateHash() == stepped->stateHash());
+    REQUIRE(cache.size() == map.blocks.size()); // Nothing left to decode while running
+    delete blocks;
+    delete stepped;
+}
+
+#ifndef GB_PROFILE // Profiles never take the fast path compiled blocks replace
+static unsigned compiledCalls = 0;
+
+static unsigned char compiledLoop(CPU &cpu){ // As the recompile tool writes 0x0153 below
+    compiledCalls++;
+    cpu.executeInline(0x3C);
+    cpu.executeInline(0x77);
+    if (compiledStops(cpu, false, 0)) return 2;
+    cpu.executeInline(0x0C);
+    cpu.executeInline(0x18);
+    return 4;
+}
+
+TEST_CASE("Recompiled blocks replace the fast path of the ROM they were compiled from") {
+    std::vector<unsigned char> rom = makeROM({
+        0x21, 0x00, 0xC0, // 0x150 LD HL, 0xC000
+        0x3C, // 0x153 INC A
+        0x77, // 0x154 LD (HL), A
+        0x0C, // 0x155 INC C
+        0x18, 0xFB, // 0x156 JR 0x0153
+    });
+    const CompiledEntry entries[] = {{0x0153, compiledLoop}};
+    CompiledROM compiled = {romHash(rom.data(), rom.size()) ^ 1, 1, entries};
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+    REQUIRE(cache.attach(compiled, blocks->cpu.memory) == 0);
+    compiled.romHash ^= 1;
+    REQUIRE(cache.attach(compiled, blocks->cpu.memory) == 1);
+    REQUIRE(cache.lookup(blocks->cpu.memory, 0x0153)->compiled == compiledLoop);
+
+    for (int chunk = 0; chunk < 300; chunk++){
+        blocks->runCycles(1237);
+        stepped->runCycles(1237);
+        if (blocks->stateHash() != stepped->stateHash()){
+            FAIL("diverged after chunk " << chunk);
+        }
+    }
+    REQUIRE(blocks->instructions == stepped->instructions);
+    REQUIRE(compiledCalls > 0);
+    delete blocks;
+    delete stepped;
+}
+#endif
+
+TEST_CASE("Blocks in RAM are decoded again when their code changes") {
+    std::vector<unsigned char> rom = makeROM({
+        0x21, 0x70, 0x01, // 0x150 LD HL, 0x0170
+        0x11, 0x00, 0xC0, // 0x153 LD DE, 0xC000
+        0x06, 0x12, // 0x156 LD B, 18
+        0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, // 0x158 copy the routine to 0xC000
+        0xCD, 0x00, 0xC0, // 0x15E CALL 0xC000
+        0x18, 0xFB, // 0x161 JR 0x015E
+    });
+    const unsigned char routine[] = {
+        0x21, 0x08, 0xC0, // 0xC000 LD HL, 0xC008
+        0x7E, // 0xC003 LD A, (HL)
+        0xEE, 0x01, // 0xC004 XOR 1
+        0x77, // 0xC006 LD (HL), A: turns the INC B below into DEC B and back
+        0x00, // 0xC007 NOP
+        0x04, // 0xC008 INC B
+        0x78, // 0xC009 LD A, B
+        0xEA, 0x00, 0xD0, // 0xC00A LD (0xD000), A
+        0xEA, 0xF0, 0xC0, // 0xC00D LD (0xC0F0), A: the routine's page, not its code
+        0x0C, // 0xC010 INC C
+        0xC9, // 0xC011 RET
+    };
+    memcpy(&rom[0x0170], routine, sizeof(routine));
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+    for (int chunk = 0; chunk < 300; chunk++){
+        blocks->runCycles(1237);
+        stepped->runCycles(1237);
+        if (blocks->stateHash() != stepped->stateHash()){
+            FAIL("diverged after chunk " << chunk);
+        }
+    }
+    REQUIRE(blocks->instructions == stepped->instructions);
+    Block *block = cache.lookup(blocks->cpu.memory, 0xC000);
+    REQUIRE(block);
+    REQUIRE(block->ram);
+    unsigned long long calls = blocks->instructions / 13;
+    REQUIRE(cache.invalidations > calls); // The routine and the block after the store, every call
+    REQUIRE(cache.invalidations * 2 < calls * 5); // Not for the store to 0xC0F0
+
+    REQUIRE(cache.refresh(*block, blocks->cpu.memory) == block); // LD (HL), A ran since it was decoded
+    blocks->cpu.memory = stepped->cpu.memory; // Same code, other contents: compared, not decoded again
+    unsigned long long invalidations = cache.invalidations;
+    REQUIRE(cache.refresh(*block, blocks->cpu.memory) == block);
+    REQUIRE(cache.invalidations == invalidations);
+    delete blocks;
+    delete stepped;
+}
+
+TEST_CASE("Blocks in HRAM stay current while IO registers are written") {
+    std::vector<unsigned char> rom = makeROM({
+        0x21, 0x70, 0x01, // 0x150 LD HL, 0x0170
+        0x11, 0x80, 0xFF, // 0x153 LD DE, 0xFF80
+        0x06, 0x06, // 0x156 LD B, 6
+        0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, // 0x158 copy the routine to 0xFF80
+        0xC3, 0x80, 0xFF, // 0x15E JP 0xFF80
+    });
+    const unsigned char routine[] = {
+        0x04, // 0xFF80 INC B
+        0x78, // 0xFF81 LD A, B
+        0xE0, 0x42, // 0xFF82 LDH (SCY), A
+        0x18, 0xFA, // 0xFF84 JR 0xFF80
+    };
+    memcpy(&rom[0x0170], routine, sizeof(routine));
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+    blocks->runFrames(2); // Past the copy
+    stepped->runFrames(2);
+    unsigned generation = blocks->cpu.memory.generations[0xFF];
+    for (int chunk = 0; chunk < 100; chunk++){
+        blocks->runCycles(1237);
+        stepped->runCycles(1237);
+        if (blocks->stateHash() != stepped->stateHash()){
+            FAIL("diverged after chunk " << chunk);
+        }
+    }
+    Block *block = cache.lookup(blocks->cpu.memory, 0xFF80);
+    REQUIRE(block);
+    REQUIRE(block->ram);
+    REQUIRE(blocks->cpu.memory.generations[0xFF] == generation); // SCY, LY, STAT and IF don't count
+    blocks->cpu.memory.write(0xFF90, 0x01);
+    REQUIRE(blocks->cpu.memory.generations[0xFF] != generation);
+    REQUIRE(cache.invalidations == 0);
+    delete blocks;
+    delete stepped;
+}
+
+TEST_CASE("OAM DMA copies to OAM at once and holds the bus until it's done") {
+    std::vector<unsigned char> rom = makeROM({
+        0x21, 0x70, 0x01, // 0x150 LD HL, 0x0170
+        0x11, 0x80, 0xFF, // 0x153 LD DE, 0xFF80
+        0x06, 0x1A, // 0x156 LD B, 26
+        0x2A, 0x12, 0x13, 0x05, 0x20, 0xFA, // 0x158 copy the routine to HRAM
+        0xCD, 0x80, 0xFF, // 0x15E CALL 0xFF80
+        0xFA, 0x05, 0xFE, // 0x161 LD A, (0xFE05)
+        0xEA, 0x00, 0xC1, // 0x164 LD (0xC100), A
+        0x18, 0xF5, // 0x167 JR 0x015E
+    });
+    const unsigned char routine[] = {
+        0x06, 0x02, // 0xFF80 LD B, 0x02
+        0x78, // 0xFF82 LD A, B
+        0xE0, 0x46, // 0xFF83 LDH (DMA), A: from 0x0200
+        0xFA, 0x00, 0x02, // 0xFF85 LD A, (0x0200): the external bus is taken
+        0xEA, 0xF0, 0xFF, // 0xFF88 LD (0xFFF0), A
+        0xFA, 0x03, 0xFE, // 0xFF8B LD A, (0xFE03): so is OAM
+        0xEA, 0xF1, 0xFF, // 0xFF8E LD (0xFFF1), A
+        0xEA, 0x00, 0xC2, // 0xFF91 LD (0xC200), A: dropped
+        0x06, 0x28, // 0xFF94 LD B, 40
+        0x05, 0x20, 0xFD, // 0xFF96 wait out the 160 M-cycles
+        0xC9, // 0xFF99 RET
+    };
+    memcpy(&rom[0x0170], routine, sizeof(routine));
+    for (int i = 0; i < 0xA0; i++){
+        rom[0x0200 + i] = (i * 3 + 1) & 0xFF;
+    }
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+    for (int chunk = 0; chunk < 100; chunk++){
+        blocks->runCycles(1237);
+        stepped->runCycles(1237);
+        if (blocks->stateHash() != stepped->stateHash()){
+            FAIL("diverged after chunk " << chunk);
+        }
+    }
+    REQUIRE(blocks->instructions == stepped->instructions);
+    REQUIRE(!stepped->cpu.fault);
+
+    while (stepped->cpu.memory.dma){
+        stepped->step();
+    }
+    Memory &memory = stepped->cpu.memory;
+    REQUIRE(memory[0xFFF0] == 0xFF);
+    REQUIRE(memory[0xFFF1] == 0xFF);
+    REQUIRE(memory[0xC200] == 0x00);
+    REQUIRE(memory[0xC100] == rom[0x0205]);
+    REQUIRE(memcmp(&memory[0xFE00], &rom[0x0200], 0xA0) == 0);
+    REQUIRE(memory[DMA] == 0x02);
+
+    stepped->runCycles(1);
+    while (!stepped->cpu.memory.dma){ // Into the next transfer: a copy keeps the bus held
+        stepped->step();
+    }
+    Emulator *copy = new Emulator();
+    copy->restore(*stepped);
+    REQUIRE(copy->cpu.memory[0x0200] == 0xFF);
+    REQUIRE(copy->cpu.memory[0xC100] == 0xFF);
+    REQUIRE(copy->cpu.memory[0x8000] == 0x00); // VRAM is on the other bus
+    copy->runCycles(644);
+    REQUIRE(!copy->cpu.memory.dma);
+    REQUIRE(copy->cpu.memory[0x0200] == rom[0x0200]);
+
+    stepped->cpu.initialize(); // Mid-transfer: gives the bus back along with the deadline
+    REQUIRE(!stepped->cpu.memory.dma);
+    REQUIRE(stepped->cpu.memory[0x0200] == rom[0x0200]);
+    delete copy;
+    delete blocks;
+    delete stepped;
+}
+
+TEST_CASE("Blocks aren't decoded from the bus OAM DMA holds") {
+    std::vector<unsigned char> program = {
+        0x21, 0x00, 0x10, // 0x150 LD HL, 0x1000
+        0x7E, // 0x153 LD A, (HL): 0xC0
+    };
+    program.insert(program.end(), 61, 0x00); // 0x154 NOPs
+    const unsigned char tail[] = {
+        0xE0, 0x46, // 0x191 LDH (DMA), A: from WRAM, the ROM's bus
+        0x04, // 0x193 INC B, read as RST 38 while the bus is held
+        0x18, 0xFD, // 0x194 JR 0x0193
+    };
+    program.insert(program.end(), tail, tail + sizeof(tail));
+    std::vector<unsigned char> rom = makeROM(program);
+    rom[0x1000] = 0xC0;
+    rom[0x0038] = 0xC3; // JP 0x0193
+    rom[0x0039] = 0x93;
+    rom[0x003A] = 0x01;
+    Emulator *blocks = new Emulator();
+    Emulator *stepped = new Emulator();
+    BlockCache cache;
+    for (Emulator *run : {blocks, stepped}){
+        run->initialize();
+        run->loadROM(rom.data(), rom.size());
+    }
+    blocks->blocks = &cache;
+    for (int chunk = 0; chunk < 20; chunk++){
+        blocks->runCycles(1000);
+        stepped->runCycles(1000);
+        if (blocks->stateHash() != stepped->stateHash()){
+            FAIL("diverged after chunk " << chunk);
+        }
+    }
+    REQUIRE(stepped->cpu.SP == 0xFFAC); // RST 38 only ran while the bus was held
+    REQUIRE(cache.lookup(blocks->cpu.memory, 0x0193)->ops[0].opcode == 0x04);
+    delete blocks;
+    delete stepped;
+}
@@ -0,0 +1,206 @@
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+#include "../main/Lockstep.hpp"
+#include "../main/Workloads.hpp"
+
+/**
+ * Builds `count` emulators running a loop of vectorizable opcodes with a branch that
+ * sends lanes with an odd starting B down a different path.
+ */
+static std::vector<unsigned char> rom(0x8000, 0x00);
+
+static std::vector<Emulator *> makeLanes(size_t count){
+    const unsigned char program[] = {
+        0x04, // INC B
+        0x0D, // DEC C
+        0x09, // ADD HL, BC
+        0x07, // RLCA
+        0x13, // INC DE
+        0x17, // RLA
+        0x0F, // RRCA
+        0x29, // ADD HL, HL
+        0x1B, // DEC DE
+        0x15, // DEC D
+        0x38, 0x02, // JR C, +2
+        0x0C, // INC C
+        0x00, // NOP
+        0x24, // INC H
+        0x1C, // INC E
+        0x2D, // DEC L
+        0x80, // ADD A, B
+        0x99, // SBC A, C
+        0xAB, // XOR E
+        0x8F, // ADC A, A
+        0xBD, // CP L
+        0xA4, // AND H
+        0xB2, // OR D
+        0x93, // SUB E
+        0x47, // LD B, A
+        0x6A, // LD L, D
+        0x59, // LD E, C
+        0x7C, // LD A, H
+        0x18, 0xE1 // JR -31 (back to 0x0100)
+    };
+    memcpy(&rom[0x0100], program, sizeof(program));
+    std::vector<Emulator *> lanes;
+    for (size_t i = 0; i < count; i++){
+        Emulator *emulator = new Emulator();
+        emulator->initialize();
+        emulator->loadROM(rom.data(), rom.size());
+        emulator->cpu.BC = 0x0100 * i + i * 7;
+        emulator->cpu.AF = (i * 37) << 8;
+        lanes.push_back(emulator);
+    }
+    return lanes;
+}
+
+TEST_CASE("Lockstep lanes end in the same state as independently stepped emulators") {
+    const size_t count = 37; // Not a multiple of the vector width
+    std::vector<Emulator *> reference = makeLanes(count);
+    std::vector<Emulator *> lanes = makeLanes(count);
+    Lockstep lockstep;
+    lockstep.attach(lanes);
+    for (int i = 0; i < 5000; i++){
+        lockstep.step();
+        for (Emulator *emulator : reference){
+            emulator->step();
+        }
+    }
+    lockstep.store();
+    for (size_t i = 0; i < count; i++){
+        REQUIRE(lanes[i]->cpu.cycles == reference[i]->cpu.cycles);
+        REQUIRE(lanes[i]->stateHash() == reference[i]->stateHash());
+    }
+    REQUIRE(lockstep.vectorSteps + lockstep.scalarSteps == count * 5000);
+    for (size_t i = 0; i < count; i++){
+        delete reference[i];
+        delete lanes[i];
+    }
+}
+
+TEST_CASE("Lockstep lanes at the same PC in different ROM banks run their own bank's code") {
+    std::vector<unsigned char> banked = makeROM({
+        0xEA, 0x00, 0x20, // 0x150 LD (0x2000), A: selects bank A
+        0xC3, 0x00, 0x40, // 0x153 JP 0x4000
+    }, 0x01, 4);
+    const unsigned char loops[2][3] = {{0x04, 0x18, 0xFD}, {0x05, 0x18, 0xFD}}; // INC B / DEC B, JR -3
+    memcpy(&banked[0x4000], loops[0], 3);
+    memcpy(&banked[0x8000], loops[1], 3);
+    std::vector<Emulator *> lanes, reference;
+    for (size_t i = 0; i < 20; i++){
+        for (std::vector<Emulator *> *set : {&lanes, &reference}){
+            Emulator *emulator = new Emulator();
+            emulator->initialize();
+            emulator->loadROM(banked.data(), banked.size());
+            emulator->cpu.AF = (1 + i % 2) << 8;
+            set->push_back(emulator);
+        }
+    }
+    Lockstep lockstep;
+    lockstep.attach(lanes);
+    for (int i = 0; i < 300; i++){
+        lockstep.step();
+        for (Emulator *emulator : reference){
+            emulator->step();
+        }
+    }
+    lockstep.store();
+    for (size_t i = 0; i < lanes.size(); i++){
+        REQUIRE(lanes[i]->stateHash() == reference[i]->stateHash());
+        REQUIRE(lanes[i]->cpu.B() != 0);
+        delete lanes[i];
+        delete reference[i];
+    }
+}
+
+TEST_CASE("Lockstep lanes halt, wait out EI and enter interrupts as stepped emulators do") {
+    std::vector<unsigned char> program(0x8000, 0x00);
+    const unsigned char start[] = {
+        0x3C, // 0x100 INC A
+        0x3D, // 0x101 DEC A
+        0xE0, 0xFF, // 0x102 LDH (IE), A: a different set of interrupts per lane
+        0xFB, // 0x104 EI
+        0x04, // 0x105 INC B
+        0x76, // 0x106 HALT
+        0x14, // 0x107 INC D
+        0x18, 0xFB, // 0x108 JR 0x0105
+    };
+    memcpy(&program[0x0100], start, sizeof(start));
+    program[0x40] = 0x0C; // INC C
+    program[0x41] = 0xD9; // RETI
+    program[0x48] = 0x0C;
+    program[0x49] = 0xD9;
+    std::vector<Emulator *> lanes, reference;
+    for (size_t i = 0; i < 20; i++){
+        for (std::vector<Emulator *> *set : {&lanes, &reference}){
+            Emulator *emulator = new Emulator();
+            emulator->initialize();
+            emulator->loadROM(program.data(), program.size());
+            emulator->cpu.AF = (i * 37) << 8;
+            emulator->cpu.memory[STAT] = 0x08; // HBlank STAT interrupts, for lanes that enable them
+            set->push_back(emulator);
+        }
+    }
+    Lockstep lockstep;
+    lockstep.attach(lanes);
+    for (int i = 0; i < 20000; i++){
+        lockstep.step();
+        for (Emulator *emulator : reference){
+            emulator->step();
+        }
+    }
+    lockstep.store();
+    for (size_t i = 0; i < lanes.size(); i++){
+        REQUIRE(lanes[i]->cpu.cycles == reference[i]->cpu.cycles);
+        REQUIRE(lanes[i]->stateHash() == reference[i]->stateHash());
+    }
+    REQUIRE(lanes[1]->cpu.C() != 0x13); // IE 0x25: VBlank was entered
+#ifdef __AVX2__
+    REQUIRE(lockstep.vectorSteps > 0);
+#endif
+    for (size_t i = 0; i < lanes.size(); i++){
+        delete lanes[i];
+        delete reference[i];
+    }
+}
+
+TEST_CASE("Lockstep lanes give the bus back when OAM DMA ends, as stepped emulators do") {
+    std::vector<unsigned char> program = {
+        0x06, 0x80, // 0x150 LD B, 0x80
+        0x78, // 0x152 LD A, B
+        0xE0, 0x46, // 0x153 LDH (DMA), A: from VRAM, the ROM's bus stays free
+    };
+    program.insert(program.end(), 170, 0x00); // 0x155 NOPs past the 160 M-cycles
+    const unsigned char tail[] = {
+        0xFA, 0x00, 0x80, // LD A, (0x8000): 0xFF until the bus is given back
+        0x47, // LD B, A
+        0x18, 0xFE, // JR -2
+    };
+    program.insert(program.end(), tail, tail + sizeof(tail));
+    std::vector<unsigned char> rom = makeROM(program);
+    std::vector<Emulator *> lanes, reference;
+    for (size_t i = 0; i < 16; i++){
+        for (std::vector<Emulator *> *set : {&lanes, &reference}){
+            Emulator *emulator = new Emulator();
+            emulator->initialize();
+            emulator->loadROM(rom.data(), rom.size());
+            set->push_back(emulator);
+        }
+    }
+    Lockstep lockstep;
+    lockstep.attach(lanes);
+    for (int i = 0; i < 400; i++){
+        lockstep.step();
+        for (Emulator *emulator : reference){
+            emulator->step();
+        }
+    }
+    lockstep.store();
+    for (size_t i = 0; i < lanes.size(); i++){
+        REQUIRE(lanes[i]->stateHash() == reference[i]->stateHash());
+        REQUIRE(lanes[i]->cpu.B() == 0x00);
+        delete lanes[i];
+        delete reference[i];
+    }
+}
@@ -242,6 +242,25 @@ TEST_CASE_METHOD(CPUTest, "0x28/38:(JR cc, e) jump e steps after condition cc")
     REQUIRE(cpu.PC == 6);
 }
 
+TEST_CASE_METHOD(CPUTest, "0x20/30:(JR ncc, e) jump e steps unless condition cc") {
+    cpu.PC = 0x0000;
+    cpu.memory[cpu.PC + 1] = 0x04;
+    cpu.AF = zFlag | cFlag; // Both conditions false
+    cpu.executeOpcode(0x20);
+    REQUIRE(cpu.PC == 2);
+    cpu.memory[2 + 1] = 0xFC; // -4
+    cpu.executeOpcode(0x30);
+    REQUIRE(cpu.PC == 4);
+    cpu.AF = 0x0000;
+    cpu.memory[4 + 1] = 0xFC;
+    cpu.executeOpcode(0x20);
+    REQUIRE(cpu.PC == 2); // 4 - 4 + 2
+    cpu.memory[2 + 1] = 0x10;
+    cpu.executeOpcode(0x30);
+    REQUIRE(cpu.PC == 0x14);
+    REQUIRE(cpu.cycles == 8 + 8 + 12 + 12); // Taken jumps take 4 more cycles
+}
+
 TEST_CASE_METHOD(CPUTest, "0x*9:(ADD HL, dd), check half carry (@bit 11)") {
     cpu.AF = nFlag | cFlag; // Setting negative and carry flag
     cpu.HL = 0x8A23;
@@ -344,3 +363,280 @@ TEST_CASE_METHOD(CPUTest, "0x0F:(RRCA) rotating register A right") {
     REQUIRE(cpu.AF == (0x9D00 | cFlag)); // Register A = 0x2B (0b00101011) | carry flag set w/ rest unset
     REQUIRE(cpu.PC == 1);
 }
+
+TEST_CASE_METHOD(CPUTest, "0x*C/0x*D:(INC/DEC r) half carry follows the low nibble, C/E/L/A decoded") {
+    cpu.AF = cFlag; // Carry is kept
+    cpu.DE = 0x000F;
+    cpu.executeOpcode(0x1C);
+    REQUIRE(cpu.DE == 0x0010);
+    REQUIRE(cpu.AF == (hFlag | cFlag));
+    cpu.HL = 0x0010;
+    cpu.executeOpcode(0x2D);
+    REQUIRE(cpu.HL == 0x000F);
+    REQUIRE(cpu.AF == (nFlag | hFlag | cFlag));
+    cpu.AF = 0xFF00;
+    cpu.executeOpcode(0x3C);
+    REQUIRE(cpu.AF == (zFlag | hFlag));
+    cpu.executeOpcode(0x3D);
+    REQUIRE(cpu.AF == (0xFF00 | nFlag | hFlag));
+    cpu.BC = 0x1E00;
+    cpu.executeOpcode(0x04);
+    REQUIRE(cpu.BC == 0x1F00);
+    REQUIRE(cpu.AF == 0xFF00); // 0x1E -> 0x1F doesn't carry out of bit 3
+    REQUIRE(cpu.PC == 5);
+}
+
+TEST_CASE("Flag tables match the flags worked out bit by bit") {
+    int mismatches = 0;
+    for (int a = 0; a < 256; a++){
+        for (int b = 0; b < 256; b++){
+            for (int carry = 0; carry < 2; carry++){
+                int sum = a + b + carry;
+                int expected = (((sum & 0xFF) == 0)? zFlag:0) | (((a & 0xF) + (b & 0xF) + carry > 0xF)? hFlag:0) | ((sum > 0xFF)? cFlag:0);
+                mismatches += (flagTables.add[sum & 0x1FF] | halfCarry(a, b, sum)) != expected;
+                int difference = a - b - carry;
+                expected = (((difference & 0xFF) == 0)? zFlag:0) | nFlag | (((a & 0xF) - (b & 0xF) - carry < 0)? hFlag:0) | ((difference < 0)? cFlag:0);
+                mismatches += (flagTables.sub[difference & 0x1FF] | halfCarry(a, b, difference)) != expected;
+            }
+        }
+        int increment = (a + 1) & 0xFF;
+        mismatches += flagTables.inc[increment] != (((increment == 0)? zFlag:0) | (((a & 0xF) == 0xF)? hFlag:0));
+        int decrement = (a - 1) & 0xFF;
+        mismatches += flagTables.dec[decrement] != (((decrement == 0)? zFlag:0) | nFlag | (((a & 0xF) == 0)? hFlag:0));
+        mismatches += flagTables.logic[a] != ((a == 0)? zFlag:0);
+    }
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE_METHOD(CPUTest, "0x80-0xBF:(ALU A, r) and 0xC6-0xFE:(ALU A, u8)") {
+    cpu.AF = 0x3A00;
+    cpu.BC = 0xC600;
+    cpu.executeOpcode(0x80); // ADD A, B
+    REQUIRE(cpu.AF == (0x0000 | zFlag | hFlag | cFlag));
+    cpu.AF = 0x3A00 | cFlag;
+    cpu.DE = 0x000F;
+    cpu.executeOpcode(0x8B); // ADC A, E
+    REQUIRE(cpu.AF == (0x4A00 | hFlag));
+    cpu.AF = 0x3E00;
+    cpu.HL = 0xC000;
+    cpu.memory[0xC000] = 0x40;
+    cpu.executeOpcode(0x96); // SUB (HL)
+    REQUIRE(cpu.AF == (0xFE00 | nFlag | cFlag));
+    cpu.AF = 0x3B00 | cFlag;
+    cpu.HL = 0x2A00;
+    cpu.executeOpcode(0x9C); // SBC A, H
+    REQUIRE(cpu.AF == (0x1000 | nFlag));
+    cpu.AF = 0x5A00;
+    cpu.executeOpcode(0xA7); // AND A
+    REQUIRE(cpu.AF == (0x5A00 | hFlag));
+    cpu.executeOpcode(0xAF); // XOR A
+    REQUIRE(cpu.AF == zFlag);
+    cpu.BC = 0x0042;
+    cpu.executeOpcode(0xB1); // OR C
+    REQUIRE(cpu.AF == 0x4200);
+    cpu.executeOpcode(0xB9); // CP C
+    REQUIRE(cpu.AF == (0x4200 | zFlag | nFlag));
+    REQUIRE(cpu.PC == 8);
+    REQUIRE(cpu.cycles == 7 * 4 + 8);
+
+    cpu.memory[0x0009] = 0x43;
+    cpu.executeOpcode(0xFE); // CP u8
+    REQUIRE(cpu.AF == (0x4200 | nFlag | hFlag | cFlag));
+    cpu.memory[0x000B] = 0x0F;
+    cpu.executeOpcode(0xE6); // AND u8
+    REQUIRE(cpu.AF == (0x0200 | hFlag));
+    REQUIRE(cpu.PC == 12);
+}
+
+TEST_CASE_METHOD(CPUTest, "0x40-0x7F:(LD r, r') copies between registers and (HL)") {
+    cpu.AF = 0x1200;
+    cpu.BC = 0x3456;
+    cpu.DE = 0x789A;
+    cpu.HL = 0xC000;
+    cpu.executeOpcode(0x78); // LD A, B
+    REQUIRE(cpu.AF == 0x3400);
+    cpu.executeOpcode(0x4B); // LD C, E
+    REQUIRE(cpu.BC == 0x349A);
+    cpu.executeOpcode(0x52); // LD D, D
+    REQUIRE(cpu.DE == 0x789A);
+    cpu.executeOpcode(0x77); // LD (HL), A
+    REQUIRE(cpu.memory[0xC000] == 0x34);
+    cpu.memory[0xC000] = 0x11;
+    cpu.executeOpcode(0x46); // LD B, (HL)
+    REQUIRE(cpu.BC == 0x119A);
+    cpu.executeOpcode(0x65); // LD H, L
+    REQUIRE(cpu.HL == 0x0000);
+    REQUIRE(cpu.AF == 0x3400); // No flags are modified
+    REQUIRE(cpu.PC == 6);
+    REQUIRE(cpu.cycles == 4 * 4 + 8 + 8);
+    cpu.executeOpcode(0x76); // HALT isn't a move
+    REQUIRE(cpu.halted);
+    REQUIRE(cpu.HL == 0x0000);
+}
+
+/**
+ * DAA worked out from the correction it applies, independently of the table.
+ */
+static unsigned short referenceDaa(unsigned char a, bool n, bool h, bool c){
+    unsigned char correction = 0;
+    bool carry = c;
+    if (h || (!n && (a & 0x0F) > 0x09)){
+        correction |= 0x06;
+    }
+    if (c || (!n && a > 0x99)){
+        correction |= 0x60;
+        carry = true;
+    }
+    a = n? a - correction:a + correction;
+    return a << 8 | ((a == 0)? zFlag:0) | (n? nFlag:0) | (carry? cFlag:0);
+}
+
+TEST_CASE_METHOD(CPUTest, "0x27:(DAA) matches the reference for every A and N/H/C") {
+    int mismatches = 0;
+    for (int a = 0; a < 256; a++){
+        for (int flags = 0; flags < 8; flags++){
+            bool n = flags & 4, h = flags & 2, c = flags & 1;
+            cpu.AF = a << 8 | (n? nFlag:0) | (h? hFlag:0) | (c? cFlag:0) | zFlag;
+            cpu.executeOpcode(0x27);
+            mismatches += cpu.AF != referenceDaa(a, n, h, c);
+        }
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(cpu.PC == 2048);
+
+    cpu.AF = 0x4500;
+    cpu.BC = 0x3800;
+    cpu.executeOpcode(0x80); // ADD A, B: 0x45 + 0x38 = 0x7D
+    cpu.executeOpcode(0x27);
+    REQUIRE(cpu.AF == 0x8300); // 45 + 38 = 83 in BCD
+}
+
+TEST_CASE_METHOD(CPUTest, "0xC0-0xFF:(CALL/RET/RST/JP) follow the stack and conditions") {
+    cpu.PC = 0x0200;
+    cpu.SP = 0xDFF0;
+    cpu.memory[0x0201] = 0x34;
+    cpu.memory[0x0202] = 0x12;
+    cpu.executeOpcode(0xCD); // CALL 0x1234
+    REQUIRE(cpu.PC == 0x1234);
+    REQUIRE(cpu.SP == 0xDFEE);
+    REQUIRE(cpu.memory[0xDFEE] == 0x03);
+    REQUIRE(cpu.memory[0xDFEF] == 0x02);
+    REQUIRE(cpu.cycles == 24);
+    cpu.AF = 0x0000;
+    cpu.executeOpcode(0xC8); // RET Z, not taken
+    REQUIRE(cpu.PC == 0x1235);
+    REQUIRE(cpu.cycles == 24 + 8);
+    cpu.executeOpcode(0xC0); // RET NZ, taken
+    REQUIRE(cpu.PC == 0x0203);
+    REQUIRE(cpu.SP == 0xDFF0);
+    REQUIRE(cpu.cycles == 24 + 8 + 20);
+    cpu.executeOpcode(0xEF); // RST 0x28
+    REQUIRE(cpu.PC == 0x0028);
+    REQUIRE(cpu.memory[0xDFEE] == 0x04);
+    cpu.executeOpcode(0xC9); // RET
+    REQUIRE(cpu.PC == 0x0204);
+
+    cpu.AF = cFlag;
+    cpu.memory[0x0205] = 0x00;
+    cpu.memory[0x0206] = 0x40;
+    cpu.executeOpcode(0xD2); // JP NC, not taken
+    REQUIRE(cpu.PC == 0x0207);
+    cpu.PC = 0x0204;
+    unsigned long long before = cpu.cycles;
+    cpu.executeOpcode(0xDA); // JP C, taken
+    REQUIRE(cpu.PC == 0x4000);
+    REQUIRE(cpu.cycles - before == 16);
+    cpu.HL = 0x0150;
+    cpu.executeOpcode(0xE9); // JP HL
+    REQUIRE(cpu.PC == 0x0150);
+    REQUIRE(!cpu.fault);
+}
+
+TEST_CASE_METHOD(CPUTest, "0xC1-0xF5:(PUSH/POP qq) round trip and POP AF masks F") {
+    cpu.SP = 0xDFF0;
+    cpu.BC = 0x1234;
+    cpu.executeOpcode(0xC5); // PUSH BC
+    cpu.executeOpcode(0xF1); // POP AF
+    REQUIRE(cpu.AF == 0x1230);
+    cpu.executeOpcode(0xD5); // PUSH DE
+    cpu.executeOpcode(0xE1); // POP HL
+    REQUIRE(cpu.HL == cpu.DE);
+    REQUIRE(cpu.SP == 0xDFF0);
+    REQUIRE(cpu.PC == 4);
+    REQUIRE(cpu.cycles == 16 + 12 + 16 + 12);
+}
+
+TEST_CASE_METHOD(CPUTest, "0xE0-0xFA:(LDH/LD A, (u16)) and (ADD SP, e) flags") {
+    cpu.AF = 0x5A00;
+    cpu.memory[0x01] = 0x80;
+    cpu.executeOpcode(0xE0); // LDH (0x80), A
+    REQUIRE(cpu.memory[0xFF80] == 0x5A);
+    cpu.BC = 0x0081;
+    cpu.memory[0xFF81] = 0x77;
+    cpu.executeOpcode(0xF2); // LD A, (C)
+    REQUIRE(cpu.A() == 0x77);
+    cpu.SP = 0x00FF;
+    cpu.memory[0x04] = 0x01;
+    cpu.executeOpcode(0xE8); // ADD SP, 1
+    REQUIRE(cpu.SP == 0x0100);
+    REQUIRE(cpu.F() == (hFlag | cFlag));
+    cpu.memory[0x06] = 0xFF;
+    cpu.executeOpcode(0xF8); // LD HL, SP - 1
+    REQUIRE(cpu.HL == 0x00FF);
+    REQUIRE(cpu.SP == 0x0100);
+    REQUIRE(cpu.F() == 0);
+}
+
+/**
+ * Flipping a flag an opcode doesn't read may only change that flag afterwards, and not even that
+ * if the opcode overwrites it.
+ */
+TEST_CASE("Flag effects list the flags each opcode reads and overwrites") {
+    CPU *a = new CPU();
+    CPU *b = new CPU();
+    unsigned seed = 1;
+    auto next = [&seed]{ seed = seed * 1103515245 + 12345; return (unsigned short)(seed >> 8); };
+    int mismatches = 0;
+    for (int opcode = 0; opcode < 256; opcode++){
+        for (int trial = 0; trial < 16; trial++){
+            unsigned short regs[] = {next(), next(), next(), next(), next()};
+            unsigned char operands[] = {(unsigned char)next(), (unsigned char)next()};
+            for (unsigned char flag : {zFlag, nFlag, hFlag, cFlag}){
+                if (flagEffects.read[opcode] & flag){
+                    continue;
+                }
+                for (CPU *cpu : {a, b}){
+                    cpu->initialize();
+                    cpu->memory.clear();
+                    cpu->AF = regs[0] & 0xFFF0;
+                    cpu->BC = regs[1];
+                    cpu->DE = regs[2];
+                    cpu->HL = regs[3];
+                    cpu->SP = regs[4];
+                    cpu->PC = 0xC000;
+                    cpu->memory[0xC001] = operands[0];
+                    cpu->memory[0xC002] = operands[1];
+                }
+                b->AF ^= flag;
+                a->executeOpcode(opcode);
+                b->executeOpcode(opcode);
+                unsigned char changed = (flagEffects.written[opcode] & flag)? 0:flag;
+                bool sameBare = true;
+                for (int page = 0; page < 0x80; page++){
+                    sameBare = sameBare && memcmp(a->memory.bare[page]->data, b->memory.bare[page]->data, 256) == 0;
+                }
+                bool same = (a->AF ^ b->AF) == changed && a->BC == b->BC && a->DE == b->DE && a->HL == b->HL &&
+                    a->SP == b->SP && a->PC == b->PC && a->cycles == b->cycles && a->halted == b->halted &&
+                    memcmp(a->memory.ram, b->memory.ram, sizeof(a->memory.ram)) == 0 && sameBare;
+                if (!same){
+                    mismatches++;
+                    INFO("opcode " << opcode << " flag " << (int)flag);
+                    CHECK(same);
+                }
+            }
+        }
+    }
+    REQUIRE(mismatches == 0);
+    delete a;
+    delete b;
+}
@@ -0,0 +1,104 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../main/CodeMap.hpp"
+#include "../main/Emulator.hpp"
+using namespace std;
+
+/**
+ * Recompiles the code of a ROM ahead of time into C++: every block of its code map (<rom>.codemap,
+ * or a fresh analysis) becomes a function running the block's fast path with the same handlers the
+ * block cache picks, the plain instructions through CPU::executeInline() with a constant opcode.
+ * Build the output as a plugin against the same sources, for the runner's --plugin:
+ *   g++ -std=c++17 -O2 -shared -fPIC -I src/main -o <rom>.so <output>
+ * Code the map doesn't have (unreached statically, other banks, RAM) keeps running through the
+ * block cache and the interpreter.
+ * Blocks are fused with the default opcode pairs, so the runner doesn't take --fuse with a plugin.
+ * Usage: recompile <rom> <output>
+ */
+
+/**
+ * \return the C++ statement running `op`, or an empty string for a handler it doesn't know.
+ */
+string statement(const FastOp &op){
+    char text[96];
+    if (op.handler == interpretOpcode){
+        snprintf(text, sizeof(text), "cpu.executeInline(0x%X);", op.opcode);
+    } else if (op.opcode <= 0xFF && op.handler == deadFlagsHandlers[op.opcode]){
+        snprintf(text, sizeof(text), "deadFlagsHandlers[0x%02X](cpu, 0x%02X);", op.opcode, op.opcode);
+    } else {
+        text[0] = '\0';
+        for (size_t i = 0; i < sizeof(superinstructions) / sizeof(superinstructions[0]); i++){
+            if (op.handler == superinstructions[i].handler){
+                snprintf(text, sizeof(text), "superinstructions[%zu].handler(cpu, 0x%02X);", i, op.opcode);
+            }
+        }
+    }
+    return text;
+}
+
+int main (int argc, char *argv[]){
+    if (argc < 3){
+        cerr << "Usage: " << argv[0] << " <rom> <output>" << endl;
+        return 1;
+    }
+    vector<unsigned char> rom;
+    Memory *memory = new Memory();
+    if (!readROM(argv[1], rom) || !memory->mapROM(rom.data(), rom.size())){
+        cerr << "Could not load ROM: " << argv[1] << endl;
+        return 1;
+    }
+    CodeMap codeMap;
+    if (!codeMap.load((string(argv[1]) + ".codemap").c_str())){
+        codeMap.analyze(rom.data(), rom.size());
+    }
+    FILE *out = fopen(argv[2], "w");
+    if (!out){
+        cerr << "Could not write " << argv[2] << endl;
+        return 1;
+    }
+
+    fprintf(out, "// Recompiled from %s by recompile, see src/tools/recompile.cpp\n", argv[1]);
+    fprintf(out, "#include \"BlockCache.hpp\"\n");
+    BlockCache cache;
+    vector<unsigned> keys;
+    for (const auto &mapped : codeMap.blocks){
+        Block *block = cache.lookupKey(*memory, mapped.first);
+        if (!block){
+            continue;
+        }
+        fprintf(out, "\nstatic unsigned char block%05X(CPU &cpu){\n", mapped.first);
+        if (block->banked){
+            fprintf(out, "\tunsigned short bank = cpu.memory.bank;\n");
+        }
+        for (size_t i = 0; i < block->fastOps.size(); i++){
+            const FastOp &op = block->fastOps[i];
+            string run = statement(op);
+            if (run.empty()){
+                cerr << "No statement for the handler of opcode 0x" << hex << op.opcode << endl;
+                return 1;
+            }
+            fprintf(out, "\t%s\n", run.c_str());
+            if (op.check && i + 1 < block->fastOps.size()){
+                fprintf(out, "\tif (compiledStops(cpu, %s)) return %u;\n", block->banked? "true, bank":"false, 0", block->fastOps[i + 1].index);
+            }
+        }
+        fprintf(out, "\treturn %zu;\n}\n", block->ops.size());
+        keys.push_back(mapped.first);
+    }
+
+    fprintf(out, "\nstatic const CompiledEntry entries[] = {\n");
+    for (unsigned key : keys){
+        fprintf(out, "\t{0x%05X, block%05X},\n", key, key);
+    }
+    fprintf(out, "\t{0, nullptr}\n};\n");
+    fprintf(out, "\nextern \"C\" const CompiledROM *gbCompiledROM(){\n");
+    fprintf(out, "\tstatic const CompiledROM compiled = {0x%016llXULL, %zu, entries};\n", romHash(rom.data(), rom.size()), keys.size());
+    fprintf(out, "\treturn &compiled;\n}\n");
+    fclose(out);
+    printf("%zu blocks\n", keys.size());
+    delete memory;
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../main/Trace.hpp"
+using namespace std;
+
+/**
+ * Decodes a trace dumped by Trace::dump into a gameboy-doctor log, oldest instruction first.
+ * --cycles appends the cycle count each instruction started at.
+ * Usage: trace_decode <trace> [--cycles]
+ */
+int main (int argc, char *argv[]){
+    if (argc < 2){
+        cerr << "Usage: " << argv[0] << " <trace> [--cycles]" << endl;
+        return 1;
+    }
+    bool cycles = argc >= 3 && strcmp(argv[2], "--cycles") == 0;
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TraceHeader)){
+        cerr << "Could not read trace: " << argv[1] << endl;
+        return 1;
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED){
+        cerr << "Could not map trace: " << argv[1] << endl;
+        return 1;
+    }
+    const TraceHeader *header = (const TraceHeader *)mapping;
+    if (memcmp(header->magic, "GBTR", 4) != 0 || header->version != traceVersion || header->recordSize != sizeof(TraceRecord)
+        || sizeof(TraceHeader) + header->count * sizeof(TraceRecord) > (size_t)info.st_size){
+        cerr << "Not a trace (or a different version): " << argv[1] << endl;
+        return 1;
+    }
+    if (header->recorded > header->count){
+        cerr << "Trace starts after " << header->recorded - header->count << " overwritten instructions" << endl;
+    }
+
+    const TraceRecord *records = (const TraceRecord *)(header + 1);
+    char line[128];
+    for (unsigned long long i = 0; i < header->count; i++){
+        int length = formatDoctor(line, sizeof(line), records[i]);
+        if (cycles){
+            snprintf(line + length, sizeof(line) - length, " CY:%llu", records[i].cycles);
+        }
+        puts(line);
+    }
+    munmap(mapping, info.st_size);
+    return 0;
+}
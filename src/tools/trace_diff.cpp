@@ -0,0 +1,209 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "../main/Emulator.hpp"
+using namespace std;
+
+/**
+ * Runs a ROM against a reference gameboy-doctor log and stops at the first instruction whose
+ * state differs, printing the instructions leading up to it. The log is streamed in large
+ * blocks and only the last few lines of either side are kept, so logs of any length work.
+ * Usage: trace_diff <rom> <log> [--context N] [--no-pcmem]
+ */
+
+/**
+ * Reads a log line by line from big blocks instead of one read per line.
+ */
+class LineReader {
+public:
+    LineReader(FILE *file) : file(file), buffer(1 << 22), begin(0), end(0), eof(false){}
+
+    /**
+     * \return the next line without its line ending (valid until the next call), or nullptr at the end.
+     */
+    const char *next(size_t &length){
+        while (true){
+            char *start = &buffer[begin];
+            char *newline = (char *)memchr(start, '\n', end - begin);
+            if (newline || (eof && begin < end)){
+                length = (newline? newline:&buffer[end]) - start;
+                begin = newline? newline - &buffer[0] + 1:end;
+                if (length && start[length - 1] == '\r'){
+                    length--;
+                }
+                start[length] = '\0';
+                return start;
+            }
+            if (eof){
+                return nullptr;
+            }
+            // Move the partial line to the front and refill behind it
+            memmove(&buffer[0], start, end - begin);
+            end -= begin;
+            begin = 0;
+            if (end == buffer.size() - 1){
+                buffer.resize(buffer.size() * 2); // Lines longer than the buffer
+            }
+            size_t got = fread(&buffer[end], 1, buffer.size() - 1 - end, file);
+            end += got;
+            eof = got == 0;
+        }
+    }
+
+private:
+    FILE *file;
+    vector<char> buffer; // One byte spare to terminate the last line
+    size_t begin, end; // Unread bytes
+    bool eof;
+};
+
+static signed char hexDigits[256]; // Value of each hex digit character, -1 for anything else
+
+static void initHexDigits(){
+    memset(hexDigits, -1, sizeof(hexDigits));
+    for (int i = 0; i < 10; i++){
+        hexDigits['0' + i] = i;
+    }
+    for (int i = 0; i < 6; i++){
+        hexDigits['A' + i] = hexDigits['a' + i] = 10 + i;
+    }
+}
+
+static inline bool hexAt(const char *s, int digits, unsigned &value){
+    int bad = 0;
+    value = 0;
+    for (int i = 0; i < digits; i++){
+        int digit = hexDigits[(unsigned char)s[i]];
+        bad |= digit;
+        value = (value << 4) | (digit & 0xF);
+    }
+    return bad >= 0; // Checked once: -1 sets the sign bit
+}
+
+/**
+ * Parses "A:01 F:B0 B:00 C:13 D:00 E:D8 H:01 L:4D SP:FFFE PC:0100 PCMEM:00,C3,13,02".
+ * \return false if the line isn't in that format.
+ */
+static bool parseDoctor(const char *line, size_t length, TraceRecord &r){
+    static const int bytes[8] = {2, 7, 12, 17, 22, 27, 32, 37}; // A F B C D E H L
+    if (length < 73 || memcmp(line + 40, "SP:", 3) != 0 || memcmp(line + 48, "PC:", 3) != 0 || memcmp(line + 56, "PCMEM:", 6) != 0){
+        return false;
+    }
+    unsigned v[8], sp, pc, mem[4];
+    for (int i = 0; i < 8; i++){
+        if (!hexAt(line + bytes[i], 2, v[i])) return false;
+    }
+    if (!hexAt(line + 43, 4, sp) || !hexAt(line + 51, 4, pc)) return false;
+    for (int i = 0; i < 4; i++){
+        if (!hexAt(line + 62 + 3 * i, 2, mem[i])) return false;
+    }
+    r.AF = v[0] << 8 | v[1];
+    r.BC = v[2] << 8 | v[3];
+    r.DE = v[4] << 8 | v[5];
+    r.HL = v[6] << 8 | v[7];
+    r.SP = sp;
+    r.PC = pc;
+    for (int i = 0; i < 4; i++){
+        r.pcmem[i] = mem[i];
+    }
+    return true;
+}
+
+static bool same(const TraceRecord &a, const TraceRecord &b, bool pcmem){
+    return a.AF == b.AF && a.BC == b.BC && a.DE == b.DE && a.HL == b.HL && a.SP == b.SP && a.PC == b.PC
+        && (!pcmem || memcmp(a.pcmem, b.pcmem, 4) == 0);
+}
+
+int main (int argc, char *argv[]){
+    if (argc < 3){
+        cerr << "Usage: " << argv[0] << " <rom> <log> [--context N] [--no-pcmem]" << endl;
+        return 1;
+    }
+    size_t context = 8;
+    bool pcmem = true;
+    for (int i = 3; i < argc; i++){
+        if (strcmp(argv[i], "--context") == 0 && i + 1 < argc){
+            context = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--no-pcmem") == 0){
+            pcmem = false;
+        } else {
+            cerr << "Unknown option: " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    initHexDigits();
+    vector<unsigned char> rom;
+    Emulator *emulator = new Emulator();
+    emulator->initialize();
+    if (!readROM(argv[1], rom) || !emulator->loadROM(rom.data(), rom.size())){
+        cerr << "Could not load ROM: " << argv[1] << endl;
+        return 1;
+    }
+    FILE *log = fopen(argv[2], "rb");
+    if (!log){
+        cerr << "Could not read log: " << argv[2] << endl;
+        return 1;
+    }
+
+    Trace ours(1); // Only the instruction being compared: everything before it matched the log
+    emulator->trace = &ours;
+    size_t capacity = 1;
+    while (capacity < context + 1){
+        capacity <<= 1;
+    }
+    vector<TraceRecord> reference(capacity); // Ring of the last reference lines, for context
+    size_t mask = capacity - 1;
+
+    LineReader reader(log);
+    unsigned long long compared = 0;
+    unsigned long long lineNumber = 0;
+    size_t length;
+    const char *line;
+    int status = 0;
+    while ((line = reader.next(length))){
+        lineNumber++;
+        if (length == 0){
+            continue;
+        }
+        TraceRecord &expected = reference[compared & mask];
+        if (!parseDoctor(line, length, expected)){
+            cerr << "Line " << lineNumber << " isn't a gameboy-doctor line: " << line << endl;
+            status = 1;
+            break;
+        }
+        if (emulator->cpu.fault){
+            printf("Faulted on opcode 0x%X at 0x%04X after %llu matching instructions\n", emulator->cpu.opcode, emulator->cpu.PC, compared);
+            status = 2;
+            break;
+        }
+        unsigned long long recorded = ours.recorded();
+        do { // Interrupt entry and idle HALT steps aren't instructions, so they leave no record
+            emulator->step();
+        } while (ours.recorded() == recorded && !emulator->cpu.fault);
+        const TraceRecord &actual = ours[ours.size() - 1];
+        if (!same(actual, expected, pcmem)){
+            printf("Diverged at instruction %llu (log line %llu)\n", compared + 1, lineNumber);
+            size_t shown = min((unsigned long long)context, compared);
+            char text[128];
+            for (size_t i = shown; i > 0; i--){
+                formatDoctor(text, sizeof(text), reference[(compared - i) & mask]);
+                printf("  %s\n", text);
+            }
+            formatDoctor(text, sizeof(text), expected);
+            printf("- %s\n", text);
+            formatDoctor(text, sizeof(text), actual);
+            printf("+ %s\n", text);
+            status = 2;
+            break;
+        }
+        compared++;
+    }
+    if (status == 0){
+        printf("Matched %llu instructions\n", compared);
+    }
+    fclose(log);
+    delete emulator;
+    return status;
+}